@@ -0,0 +1,160 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data 
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu. 
+ ***************************************************************************/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <sys/mman.h> // mmap, madvise
+
+namespace cruiser{
+
+#define ARENA_CHUNK_SIZE	(2UL << 20) // One huge page
+#define ARENA_MIN_SHIFT		4 // 16 bytes
+#define ARENA_MAX_SHIFT		18 // 256 KB; bigger blocks are mapped directly
+#define ARENA_CLASSES		(ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+#define ARENA_PAGE_SIZE		4096UL
+
+// The arena that all cruiser metadata (rings, list nodes, thread records and
+// the containers) is allocated from. It is kept apart from the user heap, so
+// that an overflowing user buffer cannot reach it, and it is backed by huge 
+// pages (MAP_HUGETLB if the system has reserved some, otherwise 2 MB aligned
+// chunks advised with MADV_HUGEPAGE), so that traversing millions of nodes
+// does not also pay a dTLB miss per node.
+//
+// Blocks are carved from the chunks in power-of-two size classes and are 
+// recycled through one free list per class. The caller passes the size back
+// on deallocate(), so blocks carry no header. A spinlock is enough: the hot
+// paths (list nodes, ring growth) already cache their blocks.
+//
+// We use "struct" to avoid invoking the constructor, as the arena is used 
+// by the first malloc call, which may precede the static constructors.
+struct Arena{
+	int volatile	lock;
+	void			*freeLists[ARENA_CLASSES];
+	char			*cur, *end; // What is left of the current chunk
+
+	static unsigned sizeClass(size_t size){
+		unsigned shift = ARENA_MIN_SHIFT;
+		while(((size_t)1 << shift) < size)
+			shift++;
+		return shift - ARENA_MIN_SHIFT;
+	}
+
+	// Maps @size bytes, a multiple of ARENA_CHUNK_SIZE, of huge pages if 
+	// possible. Returns NULL on failure.
+	static void* mapHuge(size_t size){
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(p != MAP_FAILED)
+			return p;
+		// Over-map by a chunk to align the region, as transparent huge pages
+		// are only used for 2 MB aligned ranges.
+		char *raw = (char*)mmap(NULL, size + ARENA_CHUNK_SIZE, 
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(raw == MAP_FAILED)
+			return NULL;
+		char *aligned = (char*)(((unsigned long)raw + ARENA_CHUNK_SIZE - 1) 
+			& ~(ARENA_CHUNK_SIZE - 1));
+		if(aligned != raw)
+			munmap(raw, aligned - raw);
+		if(aligned + size != raw + size + ARENA_CHUNK_SIZE)
+			munmap(aligned + size, raw + ARENA_CHUNK_SIZE - aligned);
+		madvise(aligned, size, MADV_HUGEPAGE);
+		return aligned;
+	}
+
+	// Returns NULL on failure.
+	void* allocate(size_t size){
+		if(size > ((size_t)1 << ARENA_MAX_SHIFT))
+			return allocateLarge(size);
+		unsigned c = sizeClass(size);
+		size_t blockSize = (size_t)1 << (c + ARENA_MIN_SHIFT);
+		void *p;
+		while(__sync_lock_test_and_set(&lock, 1))
+			cpuRelax();
+		if((p = freeLists[c])){
+			freeLists[c] = *(void**)p;
+		}else{
+			if(cur + blockSize > end){
+				// The rest of the chunk is left unused; it is smaller than
+				// a block of the largest class.
+				cur = (char*)mapHuge(ARENA_CHUNK_SIZE);
+				end = cur ? cur + ARENA_CHUNK_SIZE : NULL;
+			}
+			if(cur){
+				p = cur;
+				cur += blockSize;
+			}
+		}
+		__sync_lock_release(&lock);
+		return p;
+	}
+
+	// @size has to be the size passed to allocate().
+	void deallocate(void *p, size_t size){
+		if(!p)
+			return;
+		if(size > ((size_t)1 << ARENA_MAX_SHIFT)){
+			munmap(p, largeSize(size));
+			return;
+		}
+		unsigned c = sizeClass(size);
+		while(__sync_lock_test_and_set(&lock, 1))
+			cpuRelax();
+		*(void**)p = freeLists[c];
+		freeLists[c] = p;
+		__sync_lock_release(&lock);
+	}
+
+private:
+	static size_t largeSize(size_t size){
+		if(size >= ARENA_CHUNK_SIZE)
+			return (size + ARENA_CHUNK_SIZE - 1) & ~(ARENA_CHUNK_SIZE - 1);
+		return (size + ARENA_PAGE_SIZE - 1) & ~(ARENA_PAGE_SIZE - 1);
+	}
+
+	static void* allocateLarge(size_t size){
+		size = largeSize(size);
+		if(size >= ARENA_CHUNK_SIZE)
+			return mapHuge(size);
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	}
+};
+
+static Arena	g_arena;
+
+// Deriving from it makes the instances of a class come from g_arena. As 
+// operator new is noexcept, a new-expression returns NULL rather than throwing
+// when the arena is out of memory.
+struct ArenaAllocated{
+	static void* operator new(size_t size) noexcept{
+		return g_arena.allocate(size);
+	}
+	static void operator delete(void *p, size_t size){
+		g_arena.deallocate(p, size);
+	}
+};
+
+}//namespace cruiser
+
+#endif //ARENA_H
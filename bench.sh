@@ -0,0 +1,108 @@
+#!/bin/bash
+# Runs benchmark.out (benchmark.cpp) under plain glibc and under each library
+# given, one process per workload and thread count, so that the RSS and the
+# cruiser threads of a run are its own. The JSON lines go to the output file
+# (default bench.jsonl); a table then compares each library with glibc.
+# With -b, the throughput is compared with an earlier output file as well, and
+# the exit status is 1 if a run is slower by more than the threshold.
+#
+# Usage: ./bench.sh [-o output] [-b baseline] [-r threshold_percent] [lib...]
+#	The libraries default to those of "make L E" that exist; a library can be
+#	given as lib.so:MODE to set CRUISER_MODE, e.g. ./libcruiser.so:eager.
+#	BENCH_WORKLOADS (default: all), BENCH_THREADS (default 1 2 4 8 16 32 64
+#	128) and BENCH_OPS (default: per workload) narrow the runs.
+#	E.g., BENCH_THREADS="1 4" ./bench.sh -b old.jsonl ./liblazycruiser.so
+
+out=bench.jsonl
+baseline=
+threshold=10
+while getopts "o:b:r:" opt; do
+	case $opt in
+	o) out=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	r) threshold=$OPTARG ;;
+	*) sed -n 's/^# Usage: //p' "$0"; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+libs="$*"
+if [ -z "$libs" ]; then
+	for lib in ./liblazycruiser.so ./libeagercruiser.so; do
+		[ -f $lib ] && libs="$libs $lib"
+	done
+fi
+workloads=${BENCH_WORKLOADS:-small powerlaw large realloc prodcons}
+threads=${BENCH_THREADS:-1 2 4 8 16 32 64 128}
+[ -x ./benchmark.out ] || { echo "./benchmark.out is missing; make benchmark"; exit 2; }
+
+: > $out
+for lib in glibc $libs; do
+	file=${lib%%:*}
+	mode=
+	[ "$lib" != "$file" ] && mode=${lib#*:}
+	label=$(basename $file)${mode:+:$mode}
+	for w in $workloads; do
+		for t in $threads; do
+			if [ $lib = glibc ]; then
+				./benchmark.out -w $w -t $t ${BENCH_OPS:+-n $BENCH_OPS} -L glibc
+			else
+				env ${mode:+CRUISER_MODE=$mode} LD_PRELOAD=$file ./benchmark.out \
+					-w $w -t $t ${BENCH_OPS:+-n $BENCH_OPS} -L $label
+			fi
+		done
+	done | tee -a $out
+done
+
+# Each library against glibc; then, with -b, each run against the baseline.
+awk -v baseline="$baseline" -v threshold=$threshold '
+function val(line, key){
+	if(!match(line, "\"" key "\":\"?[^,}\"]*"))
+		return ""
+	s = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+	sub(/^"/, "", s)
+	return s
+}
+function id(line){
+	return val(line, "label") " " val(line, "workload") " " val(line, "threads")
+}
+FILENAME == baseline{
+	old[id($0)] = val($0, "ops_per_s")
+	next
+}
+{
+	n++
+	line[n] = $0
+	if(val($0, "label") == "glibc"){
+		ops[val($0, "workload") " " val($0, "threads")] = val($0, "ops_per_s")
+		hwm[val($0, "workload") " " val($0, "threads")] = val($0, "hwm_kb")
+	}
+}
+END{
+	printf("\n%-24s %-9s %7s %12s %8s %8s %8s %10s\n", "label", "workload",
+		"threads", "ops/s", "vs.glibc", "hwm", "cruiser%", "vs.base")
+	status = 0
+	for(i = 1; i <= n; i++){
+		l = line[i]
+		key = val(l, "workload") " " val(l, "threads")
+		o = val(l, "ops_per_s")
+		rel = ops[key] ? sprintf("%.2fx", o / ops[key]) : "-"
+		mem = hwm[key] ? sprintf("%.2fx", val(l, "hwm_kb") / hwm[key]) : "-"
+		base = "-"
+		if(id(l) in old && old[id(l)] > 0){
+			change = (o - old[id(l)]) * 100 / old[id(l)]
+			base = sprintf("%+.1f%%", change)
+			if(change < -threshold){
+				base = base "!"
+				status = 1
+			}
+		}
+		printf("%-24s %-9s %7s %12.0f %8s %8s %8s %10s\n", val(l, "label"),
+			val(l, "workload"), val(l, "threads"), o, rel, mem,
+			val(l, "cruiser_cpu_pct"), base)
+	}
+	if(status)
+		printf("\nSlower than %s by more than %s%%: marked with !\n",
+			baseline, threshold)
+	exit status
+}' $baseline $out
@@ -0,0 +1,469 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ *
+ * File name: benchmark.cpp
+ * Description: allocation throughput and scaling benchmark, run under plain
+ * 	glibc or with LD_PRELOAD=./lib*cruiser.so (see bench.sh). Each worker
+ * 	thread keeps a set of live buffers and replaces a random one per
+ * 	operation, with the sizes of the workload:
+ * 		small: 8-256 bytes, uniform.
+ * 		powerlaw: 16 bytes to 1 MB, Pareto (alpha 1.2), mostly small.
+ * 		large: 64 KB to 1 MB, uniform.
+ * 		realloc: buffers grown by realloc, doubling from 16 bytes to 64 KB
+ * 			or by 64 bytes up to 16 KB, then freed.
+ * 		prodcons: half of the threads allocate powerlaw buffers and pass
+ * 			them to the other half, which free them (cross-thread frees);
+ * 			an odd thread count is rounded up, and 1 is skipped.
+ * 	One JSON object is printed per workload and thread count: operations per
+ * 	second, the percentiles of the malloc and free latency in ns (one call
+ * 	in LATENCY_SAMPLE timed, clock_gettime overhead included), the RSS and
+ * 	its peak, and the CPU time of the process and of the cruiser threads
+ * 	(those named cruiser-*) during the run.
+ * Usage: ./benchmark.out [-w workload[,workload...]] [-t threads[,threads...]]
+ * 	[-n operations] [-s seed] [-L label]
+ * 	The defaults are all the workloads, 1,2,4,8 threads and a number of
+ * 	operations per thread that depends on the workload; the label defaults
+ * 	to the library in LD_PRELOAD, or "glibc". The runs of one process share
+ * 	its heap: under lazy-cruiser, the buffers freed by a run may still be
+ * 	held by the monitor in the next one, so bench.sh starts a process per
+ * 	run.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h> // malloc/free
+#include <string.h>
+#include <math.h> // pow
+#include <pthread.h>
+#include <sched.h> // sched_yield
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include <dirent.h> // opendir
+#include <fcntl.h> // open
+#include <sys/resource.h> // getrusage
+#include "histogram.h"
+
+using namespace cruiser;
+
+#define LATENCY_SAMPLE		32 // One call in that many is timed
+#define SIZE_TABLE			4096 // Sizes drawn ahead of the run, per thread
+#define QUEUE_SIZE			1024 // prodcons; a power of two
+
+enum Workload{SMALL, POWERLAW, LARGE, REALLOC, PRODCONS, WORKLOADS};
+
+static const char * const g_workloadNames[WORKLOADS] = {
+	"small", "powerlaw", "large", "realloc", "prodcons"
+};
+// Per thread; the large buffers are few, so that the RSS stays reasonable at
+// 128 threads.
+static const unsigned g_liveBuffers[WORKLOADS] = {4096, 1024, 8, 64, 0};
+static const unsigned long g_defaultOps[WORKLOADS] = {
+	1000000, 500000, 20000, 500000, 500000
+};
+
+// A single-producer single-consumer queue of buffers.
+struct Queue{
+	void				*slots[QUEUE_SIZE];
+	unsigned volatile	head; // Advanced by the producer
+	char				pad[64];
+	unsigned volatile	tail; // Advanced by the consumer
+};
+
+struct Worker{
+	pthread_t			thread;
+	unsigned			index;
+	unsigned long long	seed;
+	unsigned long		ops;
+	Queue				*queue; // prodcons: shared by a pair
+	Histogram			mallocNs, freeNs;
+	unsigned			mallocTick, freeTick;
+	unsigned long long	begin, end; // Of its loop
+	char				pad[64];
+};
+
+static Workload				g_workload;
+static unsigned long		g_ops; // Per thread
+static unsigned				g_threads;
+static pthread_barrier_t	g_barrier;
+
+static unsigned long long nsTime(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long nextRandom(unsigned long long &x){
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+static void fillSizes(Worker &w, size_t *sizes){
+	for(unsigned i = 0; i < SIZE_TABLE; i++){
+		unsigned long long r = nextRandom(w.seed);
+		double u = ((r >> 11) + 1) / 9007199254740992.0; // (0, 1]
+		switch(g_workload){
+		case SMALL:
+			sizes[i] = 8 + r % 249;
+			break;
+		case LARGE:
+			sizes[i] = 65536 + r % (1048576 - 65536 + 1);
+			break;
+		default: // POWERLAW, PRODCONS
+			double s = 16 / pow(u, 1 / 1.2);
+			sizes[i] = s > 1048576 ? 1048576 : (size_t)s;
+			break;
+		}
+	}
+}
+
+// Times one call in LATENCY_SAMPLE; malloc and free are counted apart.
+inline static bool sampled(unsigned &tick){
+	return ++tick % LATENCY_SAMPLE == 0;
+}
+
+inline static void* timedMalloc(Worker &w, size_t size){
+	if(!sampled(w.mallocTick))
+		return malloc(size);
+	unsigned long long t = nsTime();
+	void *p = malloc(size);
+	w.mallocNs.record(nsTime() - t);
+	return p;
+}
+
+inline static void timedFree(Worker &w, void *p){
+	if(!sampled(w.freeTick)){
+		free(p);
+		return;
+	}
+	unsigned long long t = nsTime();
+	free(p);
+	w.freeNs.record(nsTime() - t);
+}
+
+// The run is timed from the first worker out of the barrier to the last one
+// to finish, as the main thread may be scheduled after the workers.
+static void startRun(Worker &w){
+	pthread_barrier_wait(&g_barrier);
+	w.begin = nsTime();
+}
+
+// The first and the last byte are written, as a program would.
+inline static void touch(void *p, size_t size){
+	if(p){
+		((char*)p)[0] = 1;
+		((char*)p)[size - 1] = 1;
+	}
+}
+
+static void replaceLoop(Worker &w){
+	unsigned live = g_liveBuffers[g_workload];
+	void **slots = (void**)calloc(live, sizeof(void*));
+	size_t *sizes = (size_t*)malloc(SIZE_TABLE * sizeof(size_t));
+	fillSizes(w, sizes);
+	startRun(w);
+	for(unsigned long i = 0; i < w.ops; i++){
+		unsigned k = nextRandom(w.seed) % live;
+		if(slots[k])
+			timedFree(w, slots[k]);
+		size_t size = sizes[i % SIZE_TABLE];
+		slots[k] = timedMalloc(w, size);
+		touch(slots[k], size);
+	}
+	for(unsigned k = 0; k < live; k++)
+		free(slots[k]);
+	free(sizes);
+	free(slots);
+}
+
+// Even slots double from 16 bytes to 64 KB, odd ones grow by 64 bytes up to
+// 16 KB; a slot at its limit is freed and starts again.
+static void reallocLoop(Worker &w){
+	unsigned live = g_liveBuffers[REALLOC];
+	void **slots = (void**)calloc(live, sizeof(void*));
+	size_t *sizes = (size_t*)calloc(live, sizeof(size_t));
+	startRun(w);
+	for(unsigned long i = 0; i < w.ops; i++){
+		unsigned k = nextRandom(w.seed) % live;
+		size_t size = sizes[k];
+		if(k & 1)
+			size = size + 64 > 16384 ? 0 : size + 64;
+		else
+			size = !size ? 16 : (size * 2 > 65536 ? 0 : size * 2);
+		if(!size){
+			timedFree(w, slots[k]);
+			slots[k] = NULL;
+		}else if(!sampled(w.mallocTick)){
+			slots[k] = realloc(slots[k], size);
+		}else{
+			unsigned long long t = nsTime();
+			slots[k] = realloc(slots[k], size);
+			w.mallocNs.record(nsTime() - t);
+		}
+		sizes[k] = size;
+		touch(slots[k], size);
+	}
+	for(unsigned k = 0; k < live; k++)
+		free(slots[k]);
+	free(sizes);
+	free(slots);
+}
+
+static void produce(Worker &w){
+	Queue &q = *w.queue;
+	size_t *sizes = (size_t*)malloc(SIZE_TABLE * sizeof(size_t));
+	fillSizes(w, sizes);
+	startRun(w);
+	for(unsigned long i = 0; i < w.ops; i++){
+		size_t size = sizes[i % SIZE_TABLE];
+		void *p = timedMalloc(w, size);
+		touch(p, size);
+		unsigned head = q.head;
+		while(head - __atomic_load_n(&q.tail, __ATOMIC_ACQUIRE) >= QUEUE_SIZE)
+			sched_yield();
+		q.slots[head % QUEUE_SIZE] = p;
+		__atomic_store_n(&q.head, head + 1, __ATOMIC_RELEASE);
+	}
+	free(sizes);
+}
+
+static void consume(Worker &w){
+	Queue &q = *w.queue;
+	startRun(w);
+	for(unsigned long i = 0; i < w.ops; i++){
+		unsigned tail = q.tail;
+		while(__atomic_load_n(&q.head, __ATOMIC_ACQUIRE) == tail)
+			sched_yield();
+		void *p = q.slots[tail % QUEUE_SIZE];
+		__atomic_store_n(&q.tail, tail + 1, __ATOMIC_RELEASE);
+		timedFree(w, p);
+	}
+}
+
+static void* workerThread(void *arg){
+	Worker &w = *(Worker*)arg;
+	switch(g_workload){
+	case REALLOC:
+		reallocLoop(w);
+		break;
+	case PRODCONS:
+		if(w.index % 2)
+			consume(w);
+		else
+			produce(w);
+		break;
+	default:
+		replaceLoop(w);
+		break;
+	}
+	w.end = nsTime();
+	return NULL;
+}
+
+// Reads "VmRSS" and "VmHWM" of the process, in KB.
+static void readRss(unsigned long &rssKB, unsigned long &hwmKB){
+	rssKB = hwmKB = 0;
+	FILE *fp = fopen("/proc/self/status", "r");
+	if(!fp)
+		return;
+	char line[128];
+	while(fgets(line, sizeof(line), fp)){
+		if(!strncmp(line, "VmRSS:", 6))
+			rssKB = strtoul(line + 6, NULL, 10);
+		else if(!strncmp(line, "VmHWM:", 6))
+			hwmKB = strtoul(line + 6, NULL, 10);
+	}
+	fclose(fp);
+}
+
+// The CPU time so far, in seconds, of the threads named cruiser-* (the
+// monitors, the transmitters and the control thread).
+static double cruiserCpu(void){
+	DIR *dir = opendir("/proc/self/task");
+	if(!dir)
+		return 0;
+	long ticks = sysconf(_SC_CLK_TCK);
+	double cpu = 0;
+	struct dirent *e;
+	while((e = readdir(dir)) != NULL){
+		if(e->d_name[0] == '.')
+			continue;
+		char path[sizeof(e->d_name) + 32], buf[512];
+		snprintf(path, sizeof(path), "/proc/self/task/%s/stat", e->d_name);
+		int fd = open(path, O_RDONLY);
+		if(fd < 0)
+			continue;
+		ssize_t n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if(n <= 0)
+			continue;
+		buf[n] = 0;
+		// pid (comm) state ppid ... utime is field 14, stime field 15.
+		char *comm = strchr(buf, '('), *end = strrchr(buf, ')');
+		if(!comm || !end || strncmp(comm + 1, "cruiser-", 8))
+			continue;
+		unsigned long utime, stime;
+		if(sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu \
+%lu", &utime, &stime) == 2)
+			cpu += (double)(utime + stime) / ticks;
+	}
+	closedir(dir);
+	return cpu;
+}
+
+static double processCpu(void){
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void printLatency(const char *name, const Histogram &h){
+	printf("\"%s\":{\"samples\":%lu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\
+\"max\":%u}", name, h.total, h.percentile(0.5), h.percentile(0.99),
+		h.percentile(0.999), h.max);
+}
+
+static void run(const char *label, unsigned long seed){
+	unsigned threads = g_threads;
+	if(g_workload == PRODCONS && threads % 2){
+		if(threads == 1)
+			return; // No pair
+		threads++;
+	}
+	Worker *workers = (Worker*)calloc(threads, sizeof(Worker));
+	Queue *queues = (Queue*)calloc(threads / 2 + 1, sizeof(Queue));
+	pthread_barrier_init(&g_barrier, NULL, threads + 1);
+	// Resets VmHWM, so that the peak is that of this run; ignored before
+	// Linux 4.0.
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if(fd >= 0){
+		ssize_t ret = write(fd, "5", 1);
+		(void)ret;
+		close(fd);
+	}
+	for(unsigned i = 0; i < threads; i++){
+		Worker &w = workers[i];
+		w.index = i;
+		w.seed = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		w.ops = g_ops;
+		w.queue = &queues[i / 2];
+		if(pthread_create(&w.thread, NULL, workerThread, &w)){
+			fprintf(stderr, "Error: thread %u cannot be created\n", i);
+			exit(1);
+		}
+	}
+	double cpu0 = processCpu(), cruiser0 = cruiserCpu();
+	pthread_barrier_wait(&g_barrier);
+	unsigned long long begin = ~0ULL, end = 0;
+	for(unsigned i = 0; i < threads; i++){
+		pthread_join(workers[i].thread, NULL);
+		if(workers[i].begin < begin)
+			begin = workers[i].begin;
+		if(workers[i].end > end)
+			end = workers[i].end;
+	}
+	double seconds = (end - begin) / 1e9;
+	double cpu = processCpu() - cpu0, cruiser = cruiserCpu() - cruiser0;
+	unsigned long rssKB, hwmKB;
+	readRss(rssKB, hwmKB);
+
+	Histogram mallocNs, freeNs;
+	memset(&mallocNs, 0, sizeof(mallocNs));
+	memset(&freeNs, 0, sizeof(freeNs));
+	unsigned long ops = 0;
+	for(unsigned i = 0; i < threads; i++){
+		mallocNs.add(workers[i].mallocNs);
+		freeNs.add(workers[i].freeNs);
+		// A buffer passed is one operation, counted by its producer.
+		if(g_workload != PRODCONS || i % 2 == 0)
+			ops += workers[i].ops;
+	}
+	printf("{\"label\":\"%s\",\"workload\":\"%s\",\"threads\":%u,\
+\"ops\":%lu,\"seconds\":%.6f,\"ops_per_s\":%.0f,", label,
+		g_workloadNames[g_workload], threads, ops, seconds, ops / seconds);
+	printLatency(g_workload == REALLOC ? "realloc_ns" : "malloc_ns",
+		mallocNs);
+	printf(",");
+	printLatency("free_ns", freeNs);
+	printf(",\"rss_kb\":%lu,\"hwm_kb\":%lu,\"cpu_s\":%.3f,\
+\"cruiser_cpu_s\":%.3f,\"cruiser_cpu_pct\":%.1f}\n", rssKB, hwmKB, cpu,
+		cruiser, seconds > 0 ? cruiser * 100 / seconds : 0);
+	fflush(stdout);
+	pthread_barrier_destroy(&g_barrier);
+	free(queues);
+	free(workers);
+}
+
+static int usage(const char *name){
+	fprintf(stderr, "Usage: %s [-w workload[,workload...]] \
+[-t threads[,threads...]] [-n operations] [-s seed] [-L label]\n\
+Workloads: small, powerlaw, large, realloc, prodcons\n", name);
+	return 1;
+}
+
+int main(int argc, char **argv){
+	char defaultWorkloads[] = "small,powerlaw,large,realloc,prodcons";
+	char defaultThreads[] = "1,2,4,8";
+	char *workloads = defaultWorkloads, *threadList = defaultThreads;
+	unsigned long ops = 0, seed = 1;
+	const char *label = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "w:t:n:s:L:")) != -1){
+		switch(opt){
+		case 'w': workloads = optarg; break;
+		case 't': threadList = optarg; break;
+		case 'n': ops = strtoul(optarg, NULL, 10); break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		case 'L': label = optarg; break;
+		default: return usage(argv[0]);
+		}
+	}
+	if(!label){
+		const char *preload = getenv("LD_PRELOAD");
+		if(preload && *preload){
+			const char *slash = strrchr(preload, '/');
+			label = slash ? slash + 1 : preload;
+		}else{
+			label = "glibc";
+		}
+	}
+
+	char *saveW, *saveT;
+	for(char *w = strtok_r(workloads, ",", &saveW); w;
+			w = strtok_r(NULL, ",", &saveW)){
+		unsigned k = 0;
+		while(k < WORKLOADS && strcmp(w, g_workloadNames[k]))
+			k++;
+		if(k == WORKLOADS)
+			return usage(argv[0]);
+		g_workload = (Workload)k;
+		g_ops = ops ? ops : g_defaultOps[k];
+		char threads[256];
+		snprintf(threads, sizeof(threads), "%s", threadList);
+		for(char *t = strtok_r(threads, ",", &saveT); t;
+				t = strtok_r(NULL, ",", &saveT)){
+			g_threads = atoi(t);
+			if(g_threads < 1 || g_threads > 1024)
+				return usage(argv[0]);
+			run(label, seed);
+		}
+	}
+	return 0;
+}
@@ -22,7 +22,11 @@
 #define CRUISER_H
 
 #include <pthread.h>
+#include <setjmp.h> // sigjmp_buf
 #include "utility.h"
+#include "arena.h"
+#include "histogram.h"
+#include "probes.h"
 // The compiler complains that the file below cannot be found.
 // sysconf(_SC_LEVEL1_DCACHE_LINESIZE) or getconf LEVEL1_DACHE_LINESIZE may work.
 // #include <include/asm-x86/cache.h> //for L1_CACHE_BYTES. 
@@ -40,11 +44,30 @@ struct CruiserNode{
 #ifndef DELAYED // ID is only needed for eager-Cruiser
 	unsigned long volatile	ID; 
 #endif
+#ifdef NODE_TAGS
+	// The time the buffer was allocated, for one in g_latencySample 
+	// buffers, otherwise 0. The monitor clears it at the first check, after
+	// recording the detection latency. With CRUISER_LEAKS (leaks.h), it then
+	// holds the round of the first check, tagged with STAMP_BIRTH, so that
+	// the age of a buffer costs no further space.
+	mutable unsigned	stamp;
+	// The allocation site (sites.h), 0 if it is unknown or not recorded.
+	unsigned			site;
+#endif
 };
 
+// The allocation site of the buffer in @node, 0 without -DNODE_TAGS.
+inline static unsigned nodeSite(const CruiserNode &node){
+#ifdef NODE_TAGS
+	return node.site;
+#else
+	return 0;
+#endif
+}
+
 // The abstract structure for storing CruiserNodes.
 // It can be a hashtable, and in the paper, it is a CruiserList.
-class NodeContainer{
+class NodeContainer:public ArenaAllocated{
 public:
 	virtual ~NodeContainer(){}
 	// Invoked by the transmitter/deliver thread.
@@ -56,6 +79,15 @@ public:
 	//	1: finished one round of traverse.
 	//	2: encountered the section boundary (not used).
 	virtual int traverse( int (*pfn)(const CruiserNode &) ) = 0;
+
+	// Sliced traverse: visits at most @budget nodes (0 means no limit) and
+	// returns 2 at the section boundary; the next call resumes from there.
+	// Returns 1 when a round is finished.
+	virtual int traverse( int (*pfn)(const CruiserNode &), unsigned budget) = 0;
+
+	// Calls @pfn on each node without checking or removing any. Only used
+	// while the cruiser threads are paused (see finalCheck()).
+	virtual void visit( void (*pfn)(const CruiserNode &) ) = 0;
 };
 
 // Cruiser responds to the process exit following a finite-state machine
@@ -65,11 +97,28 @@ enum   EXIT_PROCEDURE		{RUNNING, EXIT_HOOKED, TRANSMITTER_BEGIN,
 // How should cruiser respond to a detected buffer overflow?
 enum   PRO_ATTACK 		{TO_ABORT, TO_EXIT, TO_GOON};
 
+// What should the producer do when its cruiser ring is full and cannot grow
+// (the ring has reached MAX_RING_SIZE or a new ring cannot be allocated)?
+//	RING_GROW: keep chaining MAX_RING_SIZE rings; drop only if allocation fails.
+//	RING_SPIN: spin for a bounded number of iterations waiting for the 
+//				transmitter to make room; drop if it does not.
+//	RING_OVERFLOW: push the node into the shared overflow queue.
+//	RING_BYPASS: leave the buffer unmonitored; it is freed eagerly.
+// Set by CRUISER_RING_FULL=grow|spin|overflow|bypass.
+enum   RING_FULL_POLICY	{RING_GROW, RING_SPIN, RING_OVERFLOW, RING_BYPASS};
+
 // "static" below is used to avoid global naming pollution, which is 
 // unncecessary, as we have used the namespace.
 
 static EXIT_PROCEDURE volatile 	g_exit_procedure = RUNNING;
 static const PRO_ATTACK			g_pro_attack = TO_ABORT;
+static RING_FULL_POLICY			g_ring_full_policy = RING_GROW;
+static unsigned					g_ring_spin_count = 1000; // CRUISER_RING_SPIN
+#ifdef RING_BATCH
+// The transmitter picks up unpublished ring entries after this many 
+// microseconds (CRUISER_PUBLISH_US).
+static unsigned					g_publish_us = 1000;
+#endif
 // g_initialized:
 //	0: init() has not bee invoked
 //	1: init() has been invoked
@@ -82,12 +131,72 @@ static unsigned long 			g_canary;
 #ifdef DELAYED
 static unsigned long			g_canary_free;
 static unsigned long			g_canary_realloc;
+// A buffer that could not be handed to the monitor carries this canary 
+// instead of g_canary, so that free() checks and releases it by itself.
+static unsigned long			g_canary_unmonitored;
 #endif //DELAYED
 static pthread_t 				g_monitor; // The monitor thread ID
-static pthread_t				g_transmitter; // The transmitter thread ID
+// Lazy start: monitor No.0 waits until the program has made 
+// CRUISER_START_CALLS malloc/free calls or has run for CRUISER_START_MS 
+// milliseconds before it sets up the containers and creates the other cruiser
+// threads, so short-lived processes do not pay for them. Until then, the 
+// buffers wait in the rings.
+// g_started:
+//	0: monitor No.0 is waiting for the start
+//	1: the cruiser threads will not start (NMONITOR, or the process exits)
+//	2: the cruiser threads have started
+#define START_POLL_PERIOD		64 // Calls between two updates by a thread
+static int volatile				g_started;
+static pthread_mutex_t			g_startMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			g_startCond = PTHREAD_COND_INITIALIZER;
+static unsigned					g_start_calls = 4096;
+static unsigned					g_start_us = 20000;
+static unsigned long volatile	g_startCalls; // Calls counted so far
+// CRUISER_NUMA: each NUMA node has its own containers, fed by transmitters
+// and checked by a monitor, all bound to the node; the thread records are
+// routed to the node their owner last ran on.
+#define MAX_NUMA_NODES			8
+static unsigned					g_numaNodes = 1; // Nodes monitored separately
+static pthread_t				g_nodeMonitor[MAX_NUMA_NODES]; // [0] = g_monitor
+// The number of monitors that have finished their last round at exit.
+static unsigned volatile		g_monitorExitCount;
+#define MAX_TRANSMITTERS		16
+#define REBALANCE_INTERVAL_US	100000U
+// The transmitter thread IDs; CRUISER_TRANSMITTERS sets how many are created
+// (per node). Transmitters No. n * g_txPerNode ... are those of node n.
+static pthread_t				g_transmitter[MAX_TRANSMITTERS];
+static unsigned					g_transmitterCount = 1;
+static unsigned					g_txPerNode = 1;
+// CRUISER_FUSED: the monitor thread also does the transmitter's work, 
+// checking g_fused_slice (CRUISER_FUSED_SLICE) buffers between ring drains.
+static bool						g_fused = false;
+static unsigned					g_fused_slice = 256;
+#define FUSED_MAX_PASSES		4
+#define FUSED_QUIET_FACTOR		8
+// The container traversed by the monitor (of node 0).
 static NodeContainer			*g_nodeContainer = NULL;
+// The container traversed by the monitor of each node.
+static NodeContainer			*g_nodeContainers[MAX_NUMA_NODES];
+// The part of g_nodeContainer fed by each transmitter. 
+static NodeContainer			*g_shards[MAX_TRANSMITTERS];
+#ifdef DELAYED
+// Monitor assist (CRUISER_ASSIST_MS): once a round has taken longer than 
+// g_assist_us, the monitor sets g_assist_wanted and the threads calling 
+// malloc/free check ASSIST_BUDGET buffers each until the round is finished.
+// The traverse position is shared, so whoever traverses holds g_traverseLock.
+#define ASSIST_BUDGET			16
+#define ASSIST_MONITOR_SLICE	1024
+static unsigned					g_assist_us = 0;
+static int volatile				g_assist_wanted;
+static int volatile				g_traverseLock;
+static unsigned volatile		g_assistingThreads; // In assist() (see finalCheck)
+static int volatile				g_forking; // No assist begins (see forkPrepare)
+// The number of rounds finished by the monitor and the assisting threads.
+static unsigned long volatile	g_roundsDone;
+#endif //DELAYED
 
 static unsigned					g_init_begin_time;
+static unsigned					g_init_us; // How long init() took
 
 typedef void*					(*malloc_type)(size_t);
 typedef void					(*free_type)(void*);
@@ -104,19 +213,46 @@ static volatile pid_t 			g_pid;
 static char			cache_pad2[L1_CACHE_BYTES]; // Used to avoid false sharing
 // The variables below keep changing.
 
-// If the transmitter goes through the list of cruiser rings but doesn't get to 
-// "consume" any ring elements, the program is considered "still".
-// So the transmitter may consider go to sleep for a while.
-static unsigned int volatile	g_transmitter_still_count;
+// The total number of nodes drained by the transmitters. The monitor watches
+// it to tell whether the program is allocating.
+static unsigned long volatile	g_transmittedCount;
+// The number of transmitters that have finished their last pass at exit.
+static unsigned volatile		g_transmitterExitCount;
+// With -DNODE_TAGS, one in g_latencySample buffers is stamped with the time
+// of its allocation, from which the monitor measures the detection latency of
+// that sample. The stamp wraps at STAMP_BIRTH, so that it is never taken for
+// a birth round. The sample is changed through the control socket.
+#define LATENCY_SAMPLE					64
+#define STAMP_BIRTH						0x80000000U
+static unsigned volatile		g_latencySample = LATENCY_SAMPLE;
+// Set through the control socket while it waits for a full round of each
+// monitor; the monitors then do not delay their rounds.
+static int volatile				g_scanWanted;
+
+// Round time of each node's monitor.
+static unsigned long			g_nodeRoundCount[MAX_NUMA_NODES];
+static unsigned long long		g_nodeRoundUs[MAX_NUMA_NODES];
+static unsigned					g_nodeMaxRoundUs[MAX_NUMA_NODES];
 
-// Only make sense for single-threaded process, as they are not counted
-// in a thread-safe way. "volatile" is probably unncecssary
-#ifdef SINGLE_EXP 
-static unsigned	volatile		g_malloc_count;
-static unsigned	volatile		g_calloc_count;
-static unsigned	volatile		g_realloc_count;
-static unsigned	volatile		g_free_count;
-#endif //SINGLE_EXP
+// What the monitor of each node found in its last round, for the stats page.
+struct RoundFigures{
+	unsigned		buffers; // Checked
+	unsigned		liveBuffers;
+	unsigned long	liveBytes;
+	unsigned		delayedBuffers; // Released by the monitor
+	unsigned long	delayedBytes;
+};
+static RoundFigures				g_nodeLastRound[MAX_NUMA_NODES];
+// All the rounds of the monitor of each node.
+struct RoundHistograms{
+	Histogram		wallUs;
+	Histogram		cpuUs;
+	Histogram		buffers; // Checked per round
+	Histogram		latencyUs; // From the allocation to the first check
+};
+static RoundHistograms			g_nodeHistograms[MAX_NUMA_NODES];
+// Those of the calling monitor; NULL for the other threads.
+static __thread RoundHistograms	*t_histograms;
 
 #ifdef DELAYED
 #ifdef EXP // for experiment/measurement purpose
@@ -137,13 +273,13 @@ static double 					g_avgDelayedBufferCount;
 static double 					g_avgDelayedBufferSize;
 static unsigned					g_maxDelayedBufferCount;
 static unsigned					g_maxDelayedBufferSize;
-
-// Counted in processNode()
-static unsigned					g_delayedBufferSize; 
-static unsigned 				g_roundBufferCount;  
-static unsigned 				g_roundBufferSize;
 #endif //EXP
-static unsigned					g_delayedBufferCount;
+
+// Counted in processNode(), per monitor; the sizes are in words.
+static __thread unsigned		t_roundBufferCount;  
+static __thread unsigned		t_roundBufferSize;
+static __thread unsigned		t_delayedBufferCount;
+static __thread unsigned		t_delayedBufferSize; 
 
 #else //DELAYED
 // Most of time, these variable are only manipulated by the monitor thread. 
@@ -161,15 +297,24 @@ static unsigned 				g_maxLiveBufferCount;
 static double	 				g_avgSignalBufferCount;
 static unsigned 				g_maxSignalBufferCount;
 
-static unsigned					g_roundBufferCount;
-static unsigned 				g_signalBufferCount;
+static __thread unsigned		t_signalBufferCount;
 #endif
 
-static unsigned					g_liveBufferCount;
+// Counted in processNode(), per monitor; the size is in words.
+static __thread unsigned		t_roundBufferCount;
+static __thread unsigned		t_liveBufferCount;
+static __thread unsigned		t_liveBufferSize;
 static struct sigaction 		g_oact; // Old sigaction.
-static jmp_buf					g_jmp;
+// Where a monitor thread resumes when a check hits SIGSEGV.
+static __thread sigjmp_buf		t_jmp;
+static __thread bool			t_isMonitor;
 #endif //DELAYED
 
+#ifdef EXP
+// With several monitors, the statistics above are updated under this lock.
+static int volatile				g_statsLock;
+#endif
+
 
 }//namespace cruiser
 
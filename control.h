@@ -0,0 +1,452 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h> // offsetof
+#include <stdio.h> // open_memstream
+#include <stdlib.h> // strtol
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h> // timeval
+#include <sys/un.h> // sockaddr_un
+#include "common.h"
+#include "pacer.h"
+#include "thread_control.h"
+#include "stats_page.h"
+#include "events.h"
+#include "heapprof.h"
+#include "leaks.h"
+
+namespace cruiser{
+
+// CRUISER_CONTROL=1: the control socket, served by the cruiser-ctl thread,
+// so that the process can be tuned and scraped while it runs. The socket is
+// "\0cruiser.<pid>" in the abstract namespace (no file is left behind) and
+// only accepts a peer with the effective user ID of the process, or root.
+//
+// A client sends one command per line; each reply is text and ends with a
+// line of its own (see cruiser-ctl.cpp):
+//	metrics: the figures of the stats page in the Prometheus text format,
+//		ending with "# EOF".
+//	get [name]: "name value" per control (see g_controlNames), then "end".
+//	set name value: "ok" or "error <why>". The monitors apply the change
+//		after their round (see g_controlSeq).
+//	scan: waits until each monitor has run a full round, waking up the
+//		parked ones, at most CONTROL_SCAN_MS; "ok <us>" or "error <why>".
+//	heap: a heap snapshot (see heapprof.h), ending with "end".
+//	help: the commands, then "end".
+//
+// The application threads never take part: the commands are served one
+// connection at a time by the cruiser-ctl thread, which counts as paused while
+// it waits for a client.
+
+#define CONTROL_PATH			"cruiser.%d" // After the leading '\0'
+#define CONTROL_LINE			256
+#define CONTROL_TIMEOUT_MS		5000 // Of a silent client
+#define CONTROL_SCAN_MS			10000
+
+static bool						g_controlEnabled;
+static int						g_controlFd = -1;
+static pthread_t				g_controlThread;
+
+static void fillStats(StatsPage &page, const ThreadStats &stats,
+	unsigned long *sums);
+
+enum ControlName{
+	CONTROL_SLEEP_MS,
+	CONTROL_NOP,
+	CONTROL_CPU_SHARE,
+	CONTROL_MAX_ROUND_MS,
+	CONTROL_MAX_LATENCY_MS,
+	CONTROL_LATENCY_SAMPLE,
+	CONTROL_EVENTLOG_KB,
+	CONTROL_HEAPPROF_MS,
+	CONTROL_NAMES
+};
+
+// The environment variable each one starts from is CRUISER_<NAME> without
+// the unit, e.g. CRUISER_SLEEP for sleep_ms.
+static const char * const g_controlNames[CONTROL_NAMES] = {
+	"sleep_ms",
+	"nop",
+	"cpu_share",
+	"max_round_ms",
+	"max_latency_ms",
+	"latency_sample",
+	"eventlog_kb",
+	"heapprof_ms",
+};
+
+// Reads CRUISER_CONTROL; invoked by init().
+static void controlInit(void){
+	g_controlEnabled = getEnvInt("CRUISER_CONTROL", 0);
+}
+
+static long controlGet(unsigned name){
+	switch(name){
+	case CONTROL_SLEEP_MS:			return g_roundMsSleep;
+	case CONTROL_NOP:				return g_nopCount < 0 ? 0 : g_nopCount;
+	case CONTROL_CPU_SHARE:			return g_cpuShare;
+	case CONTROL_MAX_ROUND_MS:		return g_maxRoundMs;
+	case CONTROL_MAX_LATENCY_MS:	return g_maxLatencyMs;
+	case CONTROL_LATENCY_SAMPLE:	return g_latencySample;
+	case CONTROL_EVENTLOG_KB:		return g_eventLogKB;
+	case CONTROL_HEAPPROF_MS:		return g_heapProfMs;
+	}
+	return 0;
+}
+
+// Returns NULL on success, or why @value is refused.
+static const char* controlSet(unsigned name, long value){
+	if(value < (name == CONTROL_SLEEP_MS ? -1 : 0) || value > 1000000000L)
+		return "out of range";
+	switch(name){
+	case CONTROL_SLEEP_MS:			g_roundMsSleep = value; break;
+	case CONTROL_NOP:				g_nopCount = value; break;
+	case CONTROL_CPU_SHARE:
+		if(value >= 100)
+			return "out of range";
+		g_cpuShare = value;
+		break;
+	case CONTROL_MAX_ROUND_MS:		g_maxRoundMs = value; break;
+	case CONTROL_MAX_LATENCY_MS:	g_maxLatencyMs = value; break;
+	case CONTROL_LATENCY_SAMPLE:
+		if(!value)
+			return "out of range";
+		g_latencySample = value;
+		return NULL;
+	case CONTROL_EVENTLOG_KB:
+		eventLogEnable(value);
+		return NULL;
+	case CONTROL_HEAPPROF_MS:
+		// The counting is set up at the start only.
+		if(!g_heapCounting)
+			return "not counting (CRUISER_HEAPPROF or CRUISER_LEAKS)";
+		g_heapProfMs = value && value < HEAP_MIN_PERIOD_MS ?
+			HEAP_MIN_PERIOD_MS : value;
+		return NULL;
+	}
+	__sync_add_and_fetch(&g_controlSeq, 1); // For the monitors
+	return NULL;
+}
+
+static void controlMetric(FILE *fp, const char *name, const char *type,
+		const char *help, double value){
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name,
+		type, name, value);
+}
+
+// @scale converts the values into the unit of @name.
+static void controlSummary(FILE *fp, const char *name, const char *help,
+		const StatsPercentiles &p, unsigned long sum, double scale){
+	fprintf(fp, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+	fprintf(fp, "%s{quantile=\"0.5\"} %.15g\n", name, p.p50 * scale);
+	fprintf(fp, "%s{quantile=\"0.99\"} %.15g\n", name, p.p99 * scale);
+	fprintf(fp, "%s{quantile=\"0.999\"} %.15g\n", name, p.p999 * scale);
+	fprintf(fp, "%s_sum %.15g\n%s_count %lu\n", name, sum * scale, name,
+		p.count);
+}
+
+static void controlMetrics(FILE *fp){
+	StatsPage page;
+	unsigned long sums[4];
+	// Monitor No.0 rewrites g_threadStats after each round, so a copy is
+	// taken under its lock. The leak suspects are updated under the heap
+	// snapshot lock; the other figures are read without synchronization, as
+	// by the stats page.
+	while(__sync_lock_test_and_set(&g_threadStatsLock, 1))
+		cpuRelax();
+	ThreadStats stats = g_threadStats;
+	__sync_lock_release(&g_threadStatsLock);
+	while(__sync_lock_test_and_set(&g_heapSnapshotLock, 1))
+		cpuRelax();
+	fillStats(page, stats, sums);
+	__sync_lock_release(&g_heapSnapshotLock);
+
+	controlMetric(fp, "cruiser_threads", "gauge",
+		"Thread records in use.", page.threads);
+	controlMetric(fp, "cruiser_rounds_total", "counter",
+		"Rounds finished by the monitors.", page.rounds);
+	controlMetric(fp, "cruiser_last_round_seconds", "gauge",
+		"Duration of the last round of monitor No.0.", page.lastRoundUs / 1e6);
+	controlMetric(fp, "cruiser_max_round_seconds", "gauge",
+		"Longest round so far.", page.maxRoundUs / 1e6);
+	controlMetric(fp, "cruiser_list_buffers", "gauge",
+		"Buffers checked in the last round.", page.listLength);
+	controlMetric(fp, "cruiser_live_buffers", "gauge",
+		"Live buffers in the last round.", page.liveBuffers);
+	controlMetric(fp, "cruiser_live_bytes", "gauge",
+		"Live bytes in the last round.", page.liveBytes);
+	controlMetric(fp, "cruiser_delayed_buffers", "gauge",
+		"Buffers released by the monitor in the last round.",
+		page.delayedBuffers);
+	controlMetric(fp, "cruiser_delayed_bytes", "gauge",
+		"Bytes released by the monitor in the last round.",
+		page.delayedBytes);
+	controlMetric(fp, "cruiser_ring_backlog", "gauge",
+		"Nodes not yet drained from the rings.", page.ringBacklog);
+	controlMetric(fp, "cruiser_transmitted_total", "counter",
+		"Nodes drained into the lists.", page.transmitted);
+	controlMetric(fp, "cruiser_mallocs_total", "counter",
+		"Allocations.", page.mallocs);
+	controlMetric(fp, "cruiser_frees_total", "counter",
+		"Frees.", page.frees);
+	controlMetric(fp, "cruiser_allocated_bytes_total", "counter",
+		"Bytes allocated, rounded up to words.", page.bytes);
+	controlMetric(fp, "cruiser_ring_grows_total", "counter",
+		"Rings chained because the ring was full.", page.grows);
+	controlMetric(fp, "cruiser_ring_drops_total", "counter",
+		"Nodes dropped; their buffers are unmonitored.", page.drops);
+	controlMetric(fp, "cruiser_ring_fallbacks_total", "counter",
+		"Nodes passed through the overflow queue.", page.fallbacks);
+	controlMetric(fp, "cruiser_site_overflows_total", "counter",
+		"Allocations whose site was left unknown; the site table was full.",
+		page.siteOverflows);
+	controlSummary(fp, "cruiser_round_seconds", "Wall time of the rounds.",
+		page.roundWallUs, sums[0], 1e-6);
+	controlSummary(fp, "cruiser_round_cpu_seconds", "CPU time of the rounds.",
+		page.roundCpuUs, sums[1], 1e-6);
+	controlSummary(fp, "cruiser_round_buffers", "Buffers checked per round.",
+		page.roundBuffers, sums[2], 1);
+	controlSummary(fp, "cruiser_sampled_check_latency_seconds",
+		"Delay from the allocation to the first check of the sampled buffers.",
+		page.sampledLatencyUs, sums[3], 1e-6);
+	if(page.leakRounds){
+		fprintf(fp, "# HELP cruiser_leak_growth_bytes Old bytes added over \
+the checkpoints of a leak suspect.\n# TYPE cruiser_leak_growth_bytes gauge\n");
+		for(unsigned i = 0; i < page.leakCount && i < STATS_LEAKS; i++){
+			const StatsLeak &l = page.leaks[i];
+			if(l.site)
+				fprintf(fp, "cruiser_leak_growth_bytes{site=\"%u\",\
+pc=\"%#lx\"} %lu\n", l.site, l.pc, l.growth);
+			else
+				fprintf(fp, "cruiser_leak_growth_bytes{size=\"%lu-%lu\"} %lu\n",
+					l.low, l.high, l.growth);
+		}
+	}
+	fprintf(fp, "# EOF\n");
+}
+
+// Waits until each monitor has run a round that began after the call.
+static void controlScan(FILE *fp){
+	unsigned long start[MAX_NUMA_NODES];
+	for(unsigned n = 0; n < g_numaNodes; n++)
+		start[n] = ((unsigned long volatile*)g_nodeRoundCount)[n];
+	unsigned begin = getUsTime();
+	g_scanWanted = 1;
+	bool done = false;
+	idleBegin();
+	while(!done && g_exit_procedure == RUNNING &&
+			getUsTime() - begin < CONTROL_SCAN_MS * 1000U){
+		msSleep(1);
+		done = true;
+		// The round in progress at the start may have passed some buffers.
+		for(unsigned n = 0; n < g_numaNodes; n++){
+			if(((unsigned long volatile*)g_nodeRoundCount)[n] < start[n] + 2)
+				done = false;
+		}
+	}
+	g_scanWanted = 0;
+	idleEnd();
+	if(done)
+		fprintf(fp, "ok %u\n", getUsTime() - begin);
+	else if(g_exit_procedure != RUNNING)
+		fprintf(fp, "error exiting\n");
+	else
+		fprintf(fp, "error timed out\n");
+}
+
+// Writes the reply to @line into @fp.
+static void controlCommand(char *line, FILE *fp){
+	char *save;
+	char *cmd = strtok_r(line, " \t\r", &save);
+	char *name = cmd ? strtok_r(NULL, " \t\r", &save) : NULL;
+	char *value = name ? strtok_r(NULL, " \t\r", &save) : NULL;
+	if(!cmd){
+		fprintf(fp, "error empty command\n");
+	}else if(!strcmp(cmd, "metrics")){
+		controlMetrics(fp);
+	}else if(!strcmp(cmd, "get")){
+		bool found = false;
+		for(unsigned i = 0; i < CONTROL_NAMES; i++){
+			if(name && strcmp(name, g_controlNames[i]))
+				continue;
+			fprintf(fp, "%s %ld\n", g_controlNames[i], controlGet(i));
+			found = true;
+		}
+		if(found)
+			fprintf(fp, "end\n");
+		else
+			fprintf(fp, "error unknown name %s\n", name);
+	}else if(!strcmp(cmd, "set")){
+		unsigned i = 0;
+		while(name && i < CONTROL_NAMES && strcmp(name, g_controlNames[i]))
+			i++;
+		char *end = NULL;
+		long v = value ? strtol(value, &end, 10) : 0;
+		const char *error;
+		if(!name || !value)
+			error = "usage: set name value";
+		else if(i == CONTROL_NAMES)
+			error = "unknown name";
+		else if(*end)
+			error = "not a number";
+		else
+			error = controlSet(i, v);
+		if(error)
+			fprintf(fp, "error %s\n", error);
+		else
+			fprintf(fp, "ok\n");
+	}else if(!strcmp(cmd, "scan")){
+		controlScan(fp);
+	}else if(!strcmp(cmd, "heap")){
+		if(!g_heapCounting)
+			fprintf(fp, "error not counting (CRUISER_HEAPPROF or \
+CRUISER_LEAKS)\n");
+		else if(!heapSnapshot("control", fp))
+			fprintf(fp, "error no complete round yet\n");
+	}else if(!strcmp(cmd, "help")){
+		fprintf(fp, "metrics\nget [name]\nset name value\nscan\nheap\n\
+help\nend\n");
+	}else{
+		fprintf(fp, "error unknown command %s\n", cmd);
+	}
+}
+
+static bool controlSend(int fd, const char *buf, size_t size){
+	while(size){
+		ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+		if(n <= 0)
+			return false;
+		buf += n;
+		size -= n;
+	}
+	return true;
+}
+
+// Serves the commands of a client until it closes the connection.
+static void controlServe(int fd){
+	char line[CONTROL_LINE];
+	size_t len = 0;
+	for(;;){
+		idleBegin();
+		ssize_t n = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+		idleEnd();
+		if(n <= 0 || g_exit_procedure != RUNNING)
+			return;
+		len += n;
+		char *eol;
+		while((eol = (char*)memchr(line, '\n', len)) != NULL){
+			*eol = 0;
+			char *reply = NULL;
+			size_t size = 0;
+			FILE *fp = open_memstream(&reply, &size);
+			if(!fp)
+				return;
+			controlCommand(line, fp);
+			fclose(fp);
+			bool sent = controlSend(fd, reply, size);
+			free(reply);
+			if(!sent)
+				return;
+			len -= eol + 1 - line;
+			memmove(line, eol + 1, len);
+		}
+		if(len == sizeof(line) - 1){ // No newline within a line's length
+			controlSend(fd, "error line too long\n", 20);
+			return;
+		}
+	}
+}
+
+static void* controlThread(void *){
+	t_protect = 0;
+	setupCruiserThread("cruiser-ctl", 0);
+	for(;;){
+		idleBegin();
+		int fd = accept4(g_controlFd, NULL, NULL, SOCK_CLOEXEC);
+		idleEnd();
+		if(g_exit_procedure != RUNNING)
+			break;
+		if(fd < 0)
+			continue;
+		struct ucred cred;
+		socklen_t credLen = sizeof(cred);
+		struct timeval tv = {CONTROL_TIMEOUT_MS / 1000,
+			(CONTROL_TIMEOUT_MS % 1000) * 1000};
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0 &&
+				(cred.uid == geteuid() || cred.uid == 0)){
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			controlServe(fd);
+		}
+		close(fd);
+	}
+	cruiserThreadExit();
+	return NULL;
+}
+
+// Binds the socket and creates the cruiser-ctl thread; invoked by monitor
+// No.0 once the lists are set up. A failure leaves the process without
+// the socket.
+static void controlStart(void){
+	if(!g_controlEnabled)
+		return;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+		CONTROL_PATH, (int)getpid());
+	socklen_t addrLen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0 || bind(fd, (struct sockaddr*)&addr, addrLen) ||
+			listen(fd, 4)){
+		fprintf(stderr, "Error: the control socket cannot be set up\n");
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+	g_controlFd = fd;
+	__sync_add_and_fetch(&g_cruiserThreads, 1);
+	if(int thread_ret = pthread_create(&g_controlThread, NULL, controlThread,
+			NULL)){
+		fprintf(stderr, "Error: control thread cannot be created (%d)\n",
+			thread_ret);
+		cruiserThreadExit();
+		close(fd);
+		g_controlFd = -1;
+	}
+}
+
+// In the child after fork(): the socket is the parent's; the monitor of the
+// child binds its own.
+static void controlAfterFork(void){
+	if(g_controlFd >= 0){
+		close(g_controlFd);
+		g_controlFd = -1;
+	}
+}
+
+}//namespace cruiser
+
+#endif //CONTROL_H
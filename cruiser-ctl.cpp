@@ -0,0 +1,94 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ *
+ * File name: cruiser-ctl.cpp
+ * Description: sends a command to the control socket (control.h) of a process
+ * 	run with CRUISER_CONTROL=1 and prints the reply; e.g.
+ * 	"./cruiser-ctl <pid> metrics" for a Prometheus scrape, or
+ * 	"./cruiser-ctl <pid> set sleep_ms 5". The exit status is 1 if the reply
+ * 	is an error.
+ * Usage: ./cruiser-ctl pid command [argument...]
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <stddef.h> // offsetof
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+
+#define CONTROL_PATH			"cruiser.%d" // As in control.h
+
+static int usage(const char *name){
+	fprintf(stderr, "Usage: %s pid command [argument...]\n\
+Commands: metrics, get [name], set name value, scan, heap, help\n", name);
+	return 1;
+}
+
+int main(int argc, char **argv){
+	if(argc < 3)
+		return usage(argv[0]);
+	int pid = atoi(argv[1]);
+	if(pid <= 0)
+		return usage(argv[0]);
+	char line[256];
+	size_t len = 0;
+	for(int i = 2; i < argc; i++){
+		int n = snprintf(line + len, sizeof(line) - len, "%s%s",
+			i > 2 ? " " : "", argv[i]);
+		if(n < 0 || (size_t)n >= sizeof(line) - len - 1){
+			fprintf(stderr, "The command is too long\n");
+			return 1;
+		}
+		len += n;
+	}
+	line[len++] = '\n';
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	int pathLen = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+		CONTROL_PATH, pid);
+	socklen_t addrLen = offsetof(struct sockaddr_un, sun_path) + 1 + pathLen;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, addrLen)){
+		fprintf(stderr, "Cannot connect to process %d; is it run with \
+CRUISER_CONTROL=1?\n", pid);
+		return 1;
+	}
+	if(write(fd, line, len) != (ssize_t)len){
+		perror("write");
+		return 1;
+	}
+	// The reply to the one command; the process then sees the end of the
+	// connection.
+	shutdown(fd, SHUT_WR);
+	char buf[4096];
+	bool first = true, error = false;
+	ssize_t n;
+	while((n = read(fd, buf, sizeof(buf))) > 0){
+		if(first && n >= 6 && !memcmp(buf, "error ", 6))
+			error = true;
+		first = false;
+		fwrite(buf, 1, n, stdout);
+	}
+	close(fd);
+	return error ? 1 : 0;
+}
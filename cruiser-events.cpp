@@ -0,0 +1,139 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ *
+ * File name: cruiser-events.cpp
+ * Description: prints the event log (event_log.h) written by a process run
+ * 	with CRUISER_EVENTLOG=<KB>, one event per line, oldest first (the
+ * 	threads' events are drained ring by ring, so they are sorted). The log of
+ * 	a running process can be read as well; the events drained so far are
+ * 	printed.
+ * Usage: ./cruiser-events [-a] cruiser.<pid>.events...
+ * 	The time is in seconds since the log was created; -a prints the
+ * 	wall-clock time instead.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm> // stable_sort
+#include <vector>
+#include <time.h> // localtime_r
+#include <unistd.h> // getopt
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "event_log.h"
+
+using namespace cruiser;
+
+static bool earlier(const EventRecord &a, const EventRecord &b){
+	return a.us < b.us;
+}
+
+static void printTime(unsigned long long us, unsigned long long startUs,
+		bool absolute){
+	if(!absolute){
+		printf("%12.6f", (long long)(us - startUs) / 1e6);
+		return;
+	}
+	time_t seconds = us / 1000000;
+	struct tm tm;
+	char buf[32];
+	localtime_r(&seconds, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06u", buf, (unsigned)(us % 1000000));
+}
+
+// Returns false if @path is not an event log.
+static bool printLog(const char *path, bool absolute){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		perror(path);
+		return false;
+	}
+	struct stat st;
+	void *p = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(EventLogHeader))
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	EventLogHeader *log = (EventLogHeader*)p;
+	if(p == MAP_FAILED || log->magic != EVENT_LOG_MAGIC ||
+			log->version != EVENT_LOG_VERSION ||
+			log->recordSize != sizeof(EventRecord) || !log->capacity ||
+			(size_t)st.st_size < sizeof(EventLogHeader) + 
+				(size_t)log->capacity * sizeof(EventRecord)){
+		fprintf(stderr, "%s is not an event log\n", path);
+		if(p != MAP_FAILED)
+			munmap(p, st.st_size);
+		return false;
+	}
+
+	unsigned long long written = log->written;
+	unsigned long long first = written > log->capacity ?
+		written - log->capacity : 0;
+	char program[sizeof(log->program) + 1];
+	memcpy(program, log->program, sizeof(log->program));
+	program[sizeof(log->program)] = 0;
+	printf("%s: pid %d, %s-cruiser, program %s\n", path, log->pid, log->mode,
+		program);
+	printf("%llu events, %llu overwritten, %llu dropped (ring full)\n",
+		written, first, (unsigned long long)log->dropped);
+	EventRecord *records = eventRecords(log);
+	std::vector<EventRecord> events;
+	for(unsigned long long i = first; i < written; i++)
+		events.push_back(records[i % log->capacity]);
+	std::stable_sort(events.begin(), events.end(), earlier);
+	for(size_t i = 0; i < events.size(); i++){
+		const EventRecord &r = events[i];
+		printTime(r.us, log->startUs, absolute);
+		printf(" %7d  ", r.tid);
+		if(r.type > 0 && r.type < EVENT_TYPES)
+			printf(g_eventFormats[r.type], r.args[0], r.args[1], r.args[2]);
+		else
+			printf("type %u    %lu %lu %lu", r.type, r.args[0], r.args[1],
+				r.args[2]);
+		printf("\n");
+	}
+	munmap(p, st.st_size);
+	return true;
+}
+
+static int usage(const char *name){
+	fprintf(stderr, "Usage: %s [-a] cruiser.<pid>.events...\n", name);
+	return 1;
+}
+
+int main(int argc, char **argv){
+	bool absolute = false;
+	int opt;
+	while((opt = getopt(argc, argv, "a")) != -1){
+		if(opt != 'a')
+			return usage(argv[0]);
+		absolute = true;
+	}
+	if(optind >= argc)
+		return usage(argv[0]);
+	int ret = 0;
+	for(int i = optind; i < argc; i++){
+		if(i > optind)
+			printf("\n");
+		if(!printLog(argv[i], absolute))
+			ret = 1;
+	}
+	return ret;
+}
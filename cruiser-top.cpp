@@ -0,0 +1,219 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ *
+ * File name: cruiser-top.cpp
+ * Description: displays the stats page (stats_page.h) of a process run with
+ * 	CRUISER_STATS=1, one line per interval, like vmstat. The page is only
+ * 	read; the process is not signaled or traced.
+ * Usage: ./cruiser-top [-i interval_ms] [-n count] [-p] [-l] [-c] [pid]
+ * 	-p adds the percentiles of the round time, the buffers per round and the
+ * 	detection latency (from the allocation to the first check) of the
+ * 	sampled buffers after each line; the latency needs -DNODE_TAGS.
+ * 	-l adds the leak suspects of a process run with CRUISER_LEAKS (leaks.h):
+ * 	the size classes and allocation sites whose old buffers keep growing.
+ * 	Without a pid, the pages under /dev/shm are listed; if only one of them
+ * 	belongs to a running process, it is displayed. A process that ends 
+ * 	without calling exit() (_exit, abort at an attack) leaves its page
+ * 	behind with the last figures; -c removes such pages.
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <unistd.h> // getopt, usleep, access
+#include <fcntl.h> // open
+#include <dirent.h> // opendir
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "stats_page.h"
+
+using namespace cruiser;
+
+static bool isRunning(int pid){
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+	return access(path, F_OK) == 0;
+}
+
+// Returns the only page of a running process, 0 if there is none or more
+// than one. All of them are listed; those of exited processes are removed if
+// @clean is true.
+static int findPage(bool clean){
+	DIR *dir = opendir("/dev/shm");
+	if(!dir)
+		return 0;
+	int found = 0, running = 0;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL){
+		int pid;
+		char rest;
+		if(sscanf(entry->d_name, "cruiser.%d%c", &pid, &rest) != 1)
+			continue;
+		bool alive = isRunning(pid);
+		if(!alive && clean){
+			char path[64];
+			snprintf(path, sizeof(path), STATS_PAGE_PATH, pid);
+			unlink(path);
+			printf("%d (exited, removed)\n", pid);
+			continue;
+		}
+		printf("%d%s\n", pid, alive ? "" : " (exited)");
+		if(alive){
+			found = pid;
+			running++;
+		}
+	}
+	closedir(dir);
+	return running == 1 ? found : 0;
+}
+
+static const StatsPage* mapPage(int pid){
+	char path[64];
+	snprintf(path, sizeof(path), STATS_PAGE_PATH, pid);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		perror(path);
+		return NULL;
+	}
+	struct stat st;
+	void *p = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(StatsPage))
+		p = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED){
+		fprintf(stderr, "%s is not a stats page\n", path);
+		return NULL;
+	}
+	return (const StatsPage*)p;
+}
+
+static void printHeader(void){
+	printf("%8s %7s %8s %9s %9s %9s %9s %8s %9s %9s %6s %6s\n",
+		"time(s)", "round/s", "round_ms", "list", "live", "live_MB",
+		"delayed", "backlog", "malloc/s", "free/s", "grows", "drops");
+}
+
+static void printPercentiles(const char *name, const StatsPercentiles &s){
+	printf("  %-16s count %9lu  p50 %9lu  p99 %9lu  p999 %9lu  max %9lu\n",
+		name, s.count, s.p50, s.p99, s.p999, s.max);
+}
+
+static void printLeaks(const StatsPage &page){
+	if(!page.leakRounds){
+		printf("  leaks not tracked (CRUISER_LEAKS is not set)\n");
+		return;
+	}
+	if(!page.leakCount)
+		printf("  no leak suspect\n");
+	for(unsigned i = 0; i < page.leakCount && i < STATS_LEAKS; i++){
+		const StatsLeak &l = page.leaks[i];
+		char where[48];
+		if(l.site)
+			snprintf(where, sizeof(where), "site %u at %#lx", l.site, l.pc);
+		else
+			snprintf(where, sizeof(where), "size %lu-%lu", l.low, l.high);
+		printf("  leak %-28s old %9lu buffers %11lu bytes, +%lu bytes in %u \
+checkpoints\n", where, l.oldBuffers, l.oldBytes, l.growth, l.checkpoints);
+	}
+	if(page.siteOverflows)
+		printf("  %lu allocations with an unknown site (the site table is \
+full)\n", page.siteOverflows);
+}
+
+// Prints the figures of @cur, with the rates since @prev.
+static void printLine(const StatsPage &cur, const StatsPage &prev){
+	double seconds = (cur.updateUs - prev.updateUs) / 1e6;
+	double rounds = 0, mallocs = 0, frees = 0;
+	if(seconds > 0){
+		rounds = (cur.rounds - prev.rounds) / seconds;
+		mallocs = (cur.mallocs - prev.mallocs) / seconds;
+		frees = (cur.frees - prev.frees) / seconds;
+	}
+	printf("%8.1f %7.0f %8.1f %9lu %9lu %9.1f %9lu %8lu %9.0f %9.0f %6lu %6lu\n",
+		(cur.updateUs - cur.startUs) / 1e6, rounds, cur.lastRoundUs / 1e3,
+		cur.listLength, cur.liveBuffers, cur.liveBytes / 1048576.0,
+		cur.delayedBuffers, cur.ringBacklog, mallocs, frees, cur.grows,
+		cur.drops);
+}
+
+int main(int argc, char **argv){
+	int intervalMs = 1000, count = -1, opt;
+	bool clean = false, percentiles = false, leaks = false;
+	while((opt = getopt(argc, argv, "i:n:plc")) != -1){
+		switch(opt){
+			case 'i':
+				intervalMs = atoi(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'p':
+				percentiles = true;
+				break;
+			case 'l':
+				leaks = true;
+				break;
+			case 'c':
+				clean = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-i interval_ms] [-n count] [-p] "
+					"[-l] [-c] [pid]\n", argv[0]);
+				return 1;
+		}
+	}
+	int pid = optind < argc ? atoi(argv[optind]) : findPage(clean);
+	if(!pid)
+		return optind < argc ? 1 : 0;
+
+	const StatsPage *page = mapPage(pid);
+	if(!page)
+		return 1;
+	StatsPage prev, cur;
+	if(!readStatsPage(page, prev)){
+		fprintf(stderr, "Unknown stats page version\n");
+		return 1;
+	}
+	printf("pid %d, %s-cruiser\n", prev.pid, prev.mode);
+	for(int lines = 0; count < 0 || lines < count; lines++){
+		usleep(intervalMs * 1000);
+		if(!readStatsPage(page, cur)){
+			fprintf(stderr, "The stats page is locked\n");
+			return 1;
+		}
+		if(lines % 20 == 0 || percentiles || leaks)
+			printHeader();
+		printLine(cur, prev);
+		if(percentiles){
+			printPercentiles("round_us", cur.roundWallUs);
+			printPercentiles("round_cpu_us", cur.roundCpuUs);
+			printPercentiles("round_buffers", cur.roundBuffers);
+			printPercentiles("sampled_lat_us", cur.sampledLatencyUs);
+		}
+		if(leaks)
+			printLeaks(cur);
+		fflush(stdout);
+		prev = cur;
+		if(!isRunning(pid)){
+			printf("pid %d has exited\n", pid);
+			break;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,125 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data 
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu. 
+ ***************************************************************************/
+
+// The malloc family of libcruiser.so. The mode is chosen once, by CRUISER_MODE
+// (default lazy), at the first call or by the constructor, whichever comes 
+// first; after that, each call goes straight to the mode's wrapper.
+//
+// GNU ifunc is not used: the resolvers run while the libraries are relocated,
+// before the environment can be read through getenv().
+
+#include <stdio.h>
+#include <stdlib.h> // getenv
+#include <string.h>
+#include "variant.h"
+
+#define DECLARE_VARIANT(ns) namespace ns{ extern const CruiserVariant g_variant; }
+DECLARE_VARIANT(cruiser_lazy)
+DECLARE_VARIANT(cruiser_eager)
+DECLARE_VARIANT(cruiser_lazy_exp)
+DECLARE_VARIANT(cruiser_eager_exp)
+DECLARE_VARIANT(cruiser_lazy_single_exp)
+DECLARE_VARIANT(cruiser_eager_single_exp)
+DECLARE_VARIANT(cruiser_lazy_debug)
+DECLARE_VARIANT(cruiser_eager_debug)
+DECLARE_VARIANT(cruiser_lazy_spec)
+DECLARE_VARIANT(cruiser_eager_spec)
+
+namespace cruiser{
+
+// The first one is the default.
+static const CruiserVariant	*g_variants[] = {
+	&cruiser_lazy::g_variant,
+	&cruiser_eager::g_variant,
+	&cruiser_lazy_exp::g_variant,
+	&cruiser_eager_exp::g_variant,
+	&cruiser_lazy_single_exp::g_variant,
+	&cruiser_eager_single_exp::g_variant,
+	&cruiser_lazy_debug::g_variant,
+	&cruiser_eager_debug::g_variant,
+	&cruiser_lazy_spec::g_variant,
+	&cruiser_eager_spec::g_variant,
+};
+
+// Copied from the selected CruiserVariant, so that a call costs one load.
+static void*	(*g_malloc)(size_t);
+static void		(*g_free)(void*);
+static void*	(*g_realloc)(void*, size_t);
+static void*	(*g_calloc)(size_t, size_t);
+
+static void selectVariant(void){
+	if(g_malloc)
+		return;
+	const CruiserVariant *v = g_variants[0];
+	const char *mode = getenv("CRUISER_MODE");
+	bool unknown = false;
+	if(mode){
+		unknown = true;
+		for(unsigned i = 0; i < sizeof(g_variants) / sizeof(g_variants[0]); 
+				i++){
+			if(!strcmp(mode, g_variants[i]->name)){
+				v = g_variants[i];
+				unknown = false;
+				break;
+			}
+		}
+	}
+	// Set before init(), which calls malloc (e.g. through dlsym).
+	g_free = v->free;
+	g_realloc = v->realloc;
+	g_calloc = v->calloc;
+	g_malloc = v->malloc;
+	v->init();
+	if(unknown)
+		fprintf(stderr, "Cruiser: unknown CRUISER_MODE %s, %s is used\n", 
+			mode, v->name);
+}
+
+static void __attribute__((constructor)) dispatchInit(){
+	selectVariant();
+}
+
+}//namespace cruiser
+
+extern "C"{
+void* malloc(size_t size){
+	if(__builtin_expect(!cruiser::g_malloc, 0))
+		cruiser::selectVariant();
+	return cruiser::g_malloc(size);
+}
+
+void free(void* addr){
+	if(__builtin_expect(!cruiser::g_free, 0))
+		cruiser::selectVariant();
+	cruiser::g_free(addr);
+}
+
+void* realloc(void *ptr, size_t size){
+	if(__builtin_expect(!cruiser::g_realloc, 0))
+		cruiser::selectVariant();
+	return cruiser::g_realloc(ptr, size);
+}
+
+void* calloc(size_t nobj, size_t size){
+	if(__builtin_expect(!cruiser::g_calloc, 0))
+		cruiser::selectVariant();
+	return cruiser::g_calloc(nobj, size);
+}
+}//extern "C"
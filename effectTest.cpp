@@ -20,7 +20,7 @@
  * File name: effectTest.cpp
  * Description: it contains some heap errors, like overflows, duplicate-frees.
  * 	 You can use it to test the effectiveness of Cruiser.
- * Usage: ./effectTest.out [0|1|2|3|4] (pls refer to print_usage())
+ * Usage: ./effectTest.out [0|1|2|3|4|5|6|9] (pls refer to print_usage())
  ***************************************************************************/
 
 #include <stdio.h> 
@@ -30,6 +30,8 @@
 #include <fcntl.h>
 #include <sched.h> // sched_get_priority_max
 #include <unistd.h> // getpid
+#include <pthread.h>
+#include <sys/wait.h> // waitpid
 
 //#define COUNT 100
 
@@ -50,6 +52,8 @@ void print_usage(){
 		"\t3: duplicate free\n"
 		"\t4: free on an invalid address\n"
 		"\t5: special cases, such as free(null), calloc(0, 6)\n"
+		"\t6: fork while other threads allocate, then right canary corrupted\n"
+		"\t   in the last child; exits with the status of that child\n"
 		"\t9: other(original allocation function addresses)\n");
 		
 	exit(-1);	
@@ -159,6 +163,55 @@ void special(){
 
 }
 
+static volatile bool	stopChurn;
+
+static void* churn(void*){
+	void* pv[64];
+	while(!stopChurn){
+		for(int i = 0; i < 64; i++)
+			pv[i] = malloc(16 + i * 8);
+		for(int i = 0; i < 64; i++)
+			free(pv[i]);
+		usleep(1000); // Leave the CPUs to the monitor
+	}
+	return NULL;
+}
+
+// The children check that the lists they got are consistent: a freed buffer
+// still on them would be reported as an overflow, or freed twice.
+int forked(){
+	pthread_t threads[4];
+	for(int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, churn, NULL);
+	int status = 0;
+	for(int k = 0; k < 10; k++){
+		usleep(20000);
+		pid_t pid = fork();
+		if(pid == 0){
+			pthread_t thread;
+			stopChurn = false;
+			pthread_create(&thread, NULL, churn, NULL);
+			usleep(100000);
+			stopChurn = true;
+			pthread_join(thread, NULL);
+			if(k == 9)
+				right();
+			_exit(0);
+		}
+		waitpid(pid, &status, 0);
+		printf("child %d: exit %d, signal %d\n", k, 
+			WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+			WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+		if(k < 9 && status)
+			break;
+	}
+	stopChurn = true;
+	for(int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 
+		WEXITSTATUS(status);
+}
+
 void other(){
 	original_calloc = (calloc_type)dlsym(RTLD_NEXT, "calloc");
 	if(!original_calloc){
@@ -223,6 +276,8 @@ int main(int argc, char ** argv){
 		case 5:
 			special();
 			break;
+		case 6:
+			return forked();
 		case 9:
 			other();
 			break;
@@ -0,0 +1,91 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stddef.h> // NULL
+
+// The layout of the event log file shared by the monitored process (events.h)
+// and the decoder (cruiser-events.cpp); it includes nothing else of cruiser.
+//
+// With CRUISER_EVENTLOG=<KB>, the events of the process are written to
+// cruiser.<pid>.events, a file of that many KB mapped by the process: a
+// header, then a circular array of fixed-size records. Record No. i is in
+// slot i % capacity, so once the file is full the oldest records are
+// overwritten, and "written" - capacity of them are lost. The file never
+// grows.
+
+namespace cruiser{
+
+#define EVENT_LOG_MAGIC			0x45524343U // "CCRE"
+#define EVENT_LOG_VERSION		1
+#define EVENT_LOG_PATH			"cruiser.%d.events"
+
+enum EventType{
+	EVENT_INIT = 1,		// pid, init duration (us)
+	EVENT_START,		// transmitters, NUMA nodes, delay since init (us)
+	EVENT_FORK,			// parent pid, child pid
+	EVENT_ATTACK,		// user address, reason, allocation site (sites.h)
+	EVENT_EXIT,			// allocations, frees, monitor rounds
+	EVENT_TYPES
+};
+
+// How the decoder prints the arguments of each type; all of them are printed
+// as unsigned long, in decimal ("%lu") or in hexadecimal ("%#lx").
+static const char * const g_eventFormats[EVENT_TYPES] = {
+	NULL,
+	"init      pid %lu, init %lu us",
+	"start     %lu transmitter(s), %lu node(s), %lu us after init",
+	"fork      parent %lu, child %lu",
+	"attack    overflow at %#lx, reason %lu, site %lu",
+	"exit      %lu allocations, %lu frees, %lu rounds",
+};
+
+struct EventRecord{
+	unsigned long long	us; // Wall-clock time, in microseconds
+	int					tid; // Kernel thread ID
+	unsigned short		type;
+	unsigned short		reserved;
+	unsigned long		args[3];
+};
+
+struct EventLogHeader{
+	unsigned			magic;
+	unsigned			version;
+	unsigned			recordSize; // sizeof(EventRecord)
+	unsigned			capacity; // Records after the header
+	int					pid;
+	char				mode[8]; // "lazy" or "eager"
+	char				program[64];
+	unsigned long long	startUs; // When cruiser was initialized (wall clock)
+	// Records written so far; the writer bumps it after each record.
+	unsigned long long	volatile written;
+	// Events a thread could not queue because its ring was full.
+	unsigned long long	volatile dropped;
+};
+
+inline static EventRecord* eventRecords(EventLogHeader *header){
+	return (EventRecord*)(header + 1);
+}
+
+}//namespace cruiser
+
+#endif //EVENT_LOG_H
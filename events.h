@@ -0,0 +1,280 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <errno.h> // program_invocation_name
+#include <fcntl.h> // open
+#include <unistd.h> // ftruncate, syscall
+#include <sys/mman.h> // mmap
+#include <sys/syscall.h> // SYS_gettid
+#include <stdio.h> // fdopen
+#include <stdlib.h> // mkostemp
+#include <string.h>
+#include "common.h"
+#include "event_log.h"
+
+namespace cruiser{
+
+// CRUISER_EVENTLOG: the event log (see event_log.h). A thread records an
+// event into its own EventRing, which takes neither a lock nor a buffer from
+// malloc; if the ring is full, the event is counted as dropped. Monitor No.0
+// moves the rings into the file after each round, and the threads that
+// cannot wait for it (attackDetected, beforeExit) drain them themselves.
+// The file is mapped, so what was drained survives an abort.
+//
+// The rings are kept in a list like the thread records: a ring is released
+// once its owner has exited and it has been drained, and is then reused by
+// the next thread that logs.
+
+#define EVENT_RING_SIZE			64 // A power of two
+
+class EventRing:public ArenaAllocated{
+public:
+	EventRecord				slots[EVENT_RING_SIZE];
+	unsigned volatile		head; // Advanced by the owner thread
+	unsigned volatile		tail; // Advanced by the drainer
+	unsigned long volatile	dropped; // Events lost because the ring was full
+	int volatile			tid; // The owner; 0 means the ring is free.
+	int volatile			exited; // Set when the owner exits
+	EventRing * volatile	next;
+};
+
+static unsigned volatile				g_eventLogKB; // 0: no event log
+static EventRing * volatile			g_eventRings;
+static pthread_key_t				g_eventRingKey;
+static int volatile					g_eventLock; // Held while draining
+static EventLogHeader				*g_eventLog;
+static size_t						g_eventLogBytes;
+static __thread EventRing			*t_eventRing;
+
+static void eventRingExit(void *ring){
+	t_eventRing = NULL;
+	__sync_synchronize(); // All events are visible before "exited".
+	((EventRing*)ring)->exited = 1;
+}
+
+// Starts logging with a file of @kb KB, or stops if @kb is 0; invoked by
+// init() and the control socket (control.h). Once the file exists, its size
+// does not change.
+static void eventLogEnable(int kb){
+	static bool keyCreated;
+	if(kb <= 0){
+		g_eventLogKB = 0;
+		return;
+	}
+	if(!keyCreated){
+		pthread_key_create(&g_eventRingKey, eventRingExit);
+		keyCreated = true;
+	}
+	g_eventLogKB = kb < 4 ? 4 : kb;
+}
+
+// Reads CRUISER_EVENTLOG; invoked by init().
+static void eventLogInit(void){
+	eventLogEnable(getEnvInt("CRUISER_EVENTLOG", 0));
+}
+
+// Opens @path (cruiser.log by default) for appending the text reports, or
+// returns stderr. The file is not followed if it is a symlink, and a new
+// one is only readable by the user of the process. It calls fopen, so the
+// caller must have t_protect == 0.
+inline static FILE* openTextLog(const char *path = "cruiser.log"){
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		0600);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "a");
+	if(!fp && fd >= 0)
+		close(fd);
+	return fp ? fp : stderr;
+}
+
+inline static void closeTextLog(FILE *fp){
+	if(fp != stderr)
+		fclose(fp);
+}
+
+static EventRing* getEventRing(void){
+	int tid = (int)syscall(SYS_gettid);
+	EventRing *p;
+	for(p = g_eventRings; p != NULL; p = p->next){
+		if(p->tid == 0 && __sync_bool_compare_and_swap(&p->tid, 0, tid)){
+			p->exited = 0;
+			break;
+		}
+	}
+	if(!p){
+		p = new EventRing;
+		if(!p)
+			return NULL;
+		p->head = p->tail = 0;
+		p->dropped = 0;
+		p->tid = tid;
+		p->exited = 0;
+		EventRing *oldHead;
+		do{
+			oldHead = g_eventRings;
+			p->next = oldHead;
+		}while(!__sync_bool_compare_and_swap(&g_eventRings, oldHead, p));
+	}
+	pthread_setspecific(g_eventRingKey, p);
+	t_eventRing = p;
+	return p;
+}
+
+// Records an event of the calling thread; see g_eventFormats for the
+// arguments of each type. It never blocks.
+static void logEvent(unsigned type, unsigned long a0 = 0,
+		unsigned long a1 = 0, unsigned long a2 = 0){
+	if(!g_eventLogKB)
+		return;
+	EventRing *ring = t_eventRing;
+	if(!ring && !(ring = getEventRing()))
+		return;
+	unsigned head = ring->head;
+	if(head - ring->tail >= EVENT_RING_SIZE){
+		ring->dropped++;
+		return;
+	}
+	EventRecord &r = ring->slots[head % EVENT_RING_SIZE];
+	r.us = wallUsTime();
+	r.tid = ring->tid;
+	r.type = type;
+	r.reserved = 0;
+	r.args[0] = a0;
+	r.args[1] = a1;
+	r.args[2] = a2;
+	__sync_synchronize(); // The record is complete before it is published.
+	ring->head = head + 1;
+}
+
+// Creates and maps the log file of this process. As with the stats page
+// (openStatsPage, monitor.h), the file is made under a fresh name by
+// mkostemp() (mode 0600) and renamed into place, so that a symlink planted
+// at the final name is replaced rather than followed. Returns false on
+// failure.
+static bool openEventLog(void){
+	char path[64], tmp[72];
+	snprintf(path, sizeof(path), EVENT_LOG_PATH, (int)getpid());
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	size_t bytes = (size_t)g_eventLogKB * 1024;
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if(fd < 0)
+		return false;
+	EventLogHeader *log = (EventLogHeader*)MAP_FAILED;
+	if(ftruncate(fd, bytes) == 0)
+		log = (EventLogHeader*)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if(log == MAP_FAILED){
+		unlink(tmp);
+		return false;
+	}
+	log->magic = EVENT_LOG_MAGIC;
+	log->version = EVENT_LOG_VERSION;
+	log->recordSize = sizeof(EventRecord);
+	log->capacity = (bytes - sizeof(EventLogHeader)) / sizeof(EventRecord);
+	log->pid = getpid();
+#ifdef DELAYED
+	strcpy(log->mode, "lazy");
+#else
+	strcpy(log->mode, "eager");
+#endif
+	strncpy(log->program, program_invocation_name, sizeof(log->program) - 1);
+	// When init() began, as the events logged so far are older than the file.
+	log->startUs = wallUsTime() - (getUsTime() - g_init_begin_time);
+	log->written = log->dropped = 0;
+	if(rename(tmp, path) != 0){
+		munmap(log, bytes);
+		unlink(tmp);
+		return false;
+	}
+	g_eventLog = log;
+	g_eventLogBytes = bytes;
+	return true;
+}
+
+// Moves the queued events of all the threads into the log file. If another
+// thread is draining, it returns at once, unless @wait is true.
+static void drainEvents(bool wait){
+	if(!g_eventLogKB)
+		return;
+	while(__sync_lock_test_and_set(&g_eventLock, 1)){
+		if(!wait)
+			return;
+		cpuRelax();
+	}
+	if(!g_eventLog && !openEventLog()){
+		g_eventLogKB = 0;
+		__sync_lock_release(&g_eventLock);
+		return;
+	}
+	EventLogHeader *log = g_eventLog;
+	EventRecord *records = eventRecords(log);
+	unsigned long long written = log->written, dropped = 0;
+	for(EventRing *p = g_eventRings; p != NULL; p = p->next){
+		dropped += p->dropped;
+		if(!p->tid)
+			continue;
+		// Read "exited" first, so that an empty ring means everything the
+		// owner logged has been drained.
+		int exited = p->exited;
+		__sync_synchronize();
+		unsigned head = p->head;
+		__sync_synchronize();
+		for(unsigned t = p->tail; t != head; t++){
+			records[written % log->capacity] = p->slots[t % EVENT_RING_SIZE];
+			__sync_synchronize();
+			log->written = ++written;
+		}
+		p->tail = head;
+		if(exited){
+			p->exited = 0;
+			__sync_synchronize();
+			p->tid = 0; // The ring can be reused now
+		}
+	}
+	log->dropped = dropped;
+	__sync_lock_release(&g_eventLock);
+}
+
+// In the child after fork(): the parent writes the queued events into its own
+// file, and the rings of the other threads, which do not exist in the child,
+// are released.
+static void eventsAfterFork(void){
+	g_eventLock = 0;
+	if(g_eventLog){
+		munmap(g_eventLog, g_eventLogBytes);
+		g_eventLog = NULL;
+	}
+	for(EventRing *p = g_eventRings; p != NULL; p = p->next){
+		p->tail = p->head;
+		if(p != t_eventRing){
+			p->exited = 0;
+			p->tid = 0;
+		}
+	}
+	if(t_eventRing)
+		t_eventRing->tid = (int)syscall(SYS_gettid);
+}
+
+}//namespace cruiser
+
+#endif //EVENTS_H
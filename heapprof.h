@@ -0,0 +1,334 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <stdlib.h> // qsort
+#include <string.h>
+#include <sys/mman.h> // mmap
+#include "common.h"
+#include "sites.h"
+
+namespace cruiser{
+
+// CRUISER_HEAPPROF=<ms>: a heap profile taken from the monitors' rounds.
+// Each round already reads the size of every live buffer, so a monitor adds
+// it up by size class, and by allocation site with CRUISER_SITES, at no cost
+// to malloc/free. When a round is over, its totals are kept as those of the
+// node; every <ms> milliseconds, monitor No.0 adds up the last complete round
+// of each node and appends a snapshot to cruiser.<pid>.heap, and one more is
+// appended at exit:
+//
+//	heap snapshot <seq> (<why>) of <program> (pid <pid>): <ms> ms after init,
+//		<n> rounds
+//	live <buffers> buffers, <bytes> bytes
+//	size <low>-<high>: <buffers> buffers, <bytes> bytes	(one per class)
+//	site <id>: <buffers> buffers, <bytes> bytes	(by bytes, largest first)
+//	  #<i> <pc> <module>(<symbol>+<offset>)		(the frames of the site)
+//	end
+//
+// A buffer is counted in its rounded-up size in words. The buffers of unknown
+// site are in the size classes only. With CRUISER_LEAKS (leaks.h), the
+// buffers older than that many rounds are also counted apart, as "old", and
+// each line ends with "(<buffers> buffers, <bytes> bytes old)".
+
+#define HEAP_CLASSES			48 // Class k: [2^k, 2^(k+1)) bytes
+#define HEAP_MIN_PERIOD_MS		100
+#define HEAP_PROFILE_PATH		"cruiser.%d.heap"
+
+struct HeapCount{
+	unsigned long	count;
+	unsigned long	bytes;
+	unsigned long	oldCount; // Buffers older than g_leakRounds rounds
+	unsigned long	oldBytes;
+
+	void add(const HeapCount &c){
+		count += c.count;
+		bytes += c.bytes;
+		oldCount += c.oldCount;
+		oldBytes += c.oldBytes;
+	}
+};
+
+struct HeapSite{
+	unsigned		round; // The round the counts are of (HeapProfile::sites)
+	unsigned		site; // The site ID (HeapProfile::doneSites)
+	HeapCount		counts;
+};
+
+static unsigned					g_heapProfMs; // 0: no heap profile
+// CRUISER_LEAKS (leaks.h): the age in rounds from which a buffer is old; 0
+// means that the ages are not tracked.
+static unsigned					g_leakRounds;
+// Whether the monitors count the live buffers, for either of them.
+static bool						g_heapCounting;
+
+// The live buffers of a node: those of the round in progress, written by the
+// thread traversing the container of the node, and those of the last complete
+// round, read by the snapshot under "lock". It is POD, so that the profiles
+// can be static.
+struct HeapProfile{
+	HeapCount		classes[HEAP_CLASSES];
+	// Indexed by site ID; an entry of another round counts as empty, so that
+	// a round is begun without clearing the table.
+	HeapSite		*sites;
+	unsigned		*touched; // The sites counted in this round
+	unsigned		touchedCount;
+	unsigned		round;
+
+	int volatile	lock;
+	bool			done; // A round has been completed.
+	HeapCount		doneClasses[HEAP_CLASSES];
+	HeapSite		*doneSites;
+	unsigned		doneSiteCount;
+
+	// Returns false if the site tables cannot be mapped.
+	bool setup(bool withSites){
+		round = 1;
+		if(!withSites)
+			return true;
+		void *p = mmap(NULL, (2 * SITE_TABLE_SIZE + 1) * sizeof(HeapSite) +
+			SITE_TABLE_SIZE * sizeof(unsigned), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(p == MAP_FAILED)
+			return false;
+		sites = (HeapSite*)p;
+		doneSites = sites + SITE_TABLE_SIZE + 1;
+		touched = (unsigned*)(doneSites + SITE_TABLE_SIZE);
+		return true;
+	}
+
+	void addSite(unsigned site, const HeapCount &c){
+		HeapSite &s = sites[site];
+		if(s.round != round){
+			s.round = round;
+			memset(&s.counts, 0, sizeof(s.counts));
+			touched[touchedCount++] = site;
+		}
+		s.counts.add(c);
+	}
+
+	// Counts the live buffer of @node, of @wordSize words. With 
+	// CRUISER_LEAKS, the node is stamped with the round of its first check
+	// (see CruiserNode::stamp), or of the next one if the detection latency
+	// is yet to be recorded.
+	void add(const CruiserNode &node, size_t wordSize){
+		unsigned long bytes = wordSize * sizeof(long);
+		bool old = false;
+#ifdef NODE_TAGS
+		if(g_leakRounds){
+			unsigned stamp = node.stamp;
+			if(stamp & STAMP_BIRTH)
+				old = ((round - stamp) & ~STAMP_BIRTH) >= g_leakRounds;
+			else if(!stamp)
+				node.stamp = round | STAMP_BIRTH;
+		}
+#endif
+		HeapCount c = {1, bytes, old, old ? bytes : 0};
+		unsigned k = bytes ? 63 - __builtin_clzl(bytes) : 0;
+		if(k >= HEAP_CLASSES)
+			k = HEAP_CLASSES - 1;
+		classes[k].add(c);
+		unsigned site = nodeSite(node);
+		if(site && site <= SITE_TABLE_SIZE && sites)
+			addSite(site, c);
+	}
+
+	// Keeps the counts of the round just completed and begins the next one.
+	void close(void){
+		while(__sync_lock_test_and_set(&lock, 1))
+			cpuRelax();
+		memcpy(doneClasses, classes, sizeof(classes));
+		for(unsigned i = 0; i < touchedCount; i++){
+			HeapSite &s = doneSites[i];
+			s = sites[touched[i]];
+			s.site = touched[i];
+		}
+		doneSiteCount = touchedCount;
+		done = true;
+		__sync_lock_release(&lock);
+		memset(classes, 0, sizeof(classes));
+		touchedCount = 0;
+		round++;
+	}
+};
+
+static HeapProfile				g_heapProfiles[MAX_NUMA_NODES];
+static HeapProfile				g_heapMerge; // All the nodes, for a snapshot
+static int volatile				g_heapSnapshotLock;
+static unsigned					g_heapSnapshots;
+// The profile of the node whose container the thread traverses; NULL for the
+// threads that do not count (e.g. those of the final check).
+static __thread HeapProfile		*t_heapProfile;
+
+// Reads CRUISER_HEAPPROF and CRUISER_LEAKS; invoked by init().
+static void heapProfInit(void){
+	int ms = getEnvInt("CRUISER_HEAPPROF", 0);
+	if(ms > 0)
+		g_heapProfMs = ms < HEAP_MIN_PERIOD_MS ? HEAP_MIN_PERIOD_MS : ms;
+	int rounds = getEnvInt("CRUISER_LEAKS", 0);
+#ifdef NODE_TAGS
+	if(rounds > 0)
+		g_leakRounds = rounds;
+#else
+	if(rounds > 0)
+		fprintf(stderr, "Error: CRUISER_LEAKS needs -DNODE_TAGS; ignored\n");
+#endif
+	g_heapCounting = g_heapProfMs || g_leakRounds;
+}
+
+// Sets up the profiles of the nodes; invoked by setupCruiser(), once the
+// number of nodes is known.
+static void heapProfSetup(void){
+	if(!g_heapCounting)
+		return;
+	bool withSites = g_siteDepth;
+	for(unsigned n = 0; n < g_numaNodes; n++){
+		if(!g_heapProfiles[n].setup(withSites))
+			withSites = false;
+	}
+	if(!g_heapMerge.setup(withSites))
+		withSites = false;
+	if(!withSites){ // By size class only, in every node
+		for(unsigned n = 0; n < g_numaNodes; n++)
+			g_heapProfiles[n].sites = NULL;
+		g_heapMerge.sites = NULL;
+	}
+}
+
+// By bytes, largest first.
+static int heapSiteOrder(const void *a, const void *b){
+	unsigned long x = ((const HeapSite*)a)->counts.bytes;
+	unsigned long y = ((const HeapSite*)b)->counts.bytes;
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// Adds up the last complete round of all the nodes into the "done" counts
+// of g_heapMerge, and the rounds finished so far into @rounds. Returns false
+// if no node has completed a round yet. The caller holds g_heapSnapshotLock.
+static bool heapMerge(unsigned long &rounds){
+	HeapProfile &m = g_heapMerge;
+	bool any = false;
+	rounds = 0;
+	for(unsigned n = 0; n < g_numaNodes; n++){
+		HeapProfile &h = g_heapProfiles[n];
+		rounds += g_nodeRoundCount[n];
+		while(__sync_lock_test_and_set(&h.lock, 1))
+			cpuRelax();
+		if(h.done){
+			any = true;
+			for(unsigned k = 0; k < HEAP_CLASSES; k++)
+				m.classes[k].add(h.doneClasses[k]);
+			for(unsigned i = 0; m.sites && i < h.doneSiteCount; i++){
+				const HeapSite &s = h.doneSites[i];
+				m.addSite(s.site, s.counts);
+			}
+		}
+		__sync_lock_release(&h.lock);
+	}
+	m.close();
+	return any;
+}
+
+// Prints @c as "<buffers> buffers, <bytes> bytes" and the old ones if the
+// ages are tracked.
+static int printHeapCount(char *buf, size_t size, const HeapCount &c){
+	if(!g_leakRounds)
+		return snprintf(buf, size, "%lu buffers, %lu bytes", c.count, c.bytes);
+	return snprintf(buf, size, "%lu buffers, %lu bytes (%lu buffers, %lu \
+bytes old)", c.count, c.bytes, c.oldCount, c.oldBytes);
+}
+
+// Appends the last complete round of all the nodes to the profile, or writes
+// it to @out if given (see control.h); @why tells what triggered the
+// snapshot. Returns false if there is no complete round yet or the profile
+// cannot be written.
+static bool heapSnapshot(const char *why, FILE *out = NULL){
+	if(!g_heapCounting)
+		return false;
+	while(__sync_lock_test_and_set(&g_heapSnapshotLock, 1))
+		cpuRelax();
+	HeapProfile &m = g_heapMerge;
+	unsigned long rounds;
+	if(!heapMerge(rounds)){
+		__sync_lock_release(&g_heapSnapshotLock);
+		return false;
+	}
+	qsort(m.doneSites, m.doneSiteCount, sizeof(HeapSite), heapSiteOrder);
+
+	FILE *fp = out;
+	if(!fp){
+		char path[64];
+		snprintf(path, sizeof(path), HEAP_PROFILE_PATH, (int)getpid());
+		fp = fopen(path, "a");
+	}
+	if(!fp){
+		g_heapProfMs = 0;
+		__sync_lock_release(&g_heapSnapshotLock);
+		return false;
+	}
+	HeapCount live;
+	memset(&live, 0, sizeof(live));
+	for(unsigned k = 0; k < HEAP_CLASSES; k++)
+		live.add(m.doneClasses[k]);
+	char line[160];
+	fprintf(fp, "heap snapshot %u (%s) of %s (pid %lu): %u ms after init, \
+%lu rounds\n", ++g_heapSnapshots, why, program_invocation_name,
+		(unsigned long)getpid(), (getUsTime() - g_init_begin_time) / 1000,
+		rounds);
+	printHeapCount(line, sizeof(line), live);
+	fprintf(fp, "live %s\n", line);
+	for(unsigned k = 0; k < HEAP_CLASSES; k++){
+		const HeapCount &c = m.doneClasses[k];
+		if(!c.count)
+			continue;
+		printHeapCount(line, sizeof(line), c);
+		fprintf(fp, "size %lu-%lu: %s\n", k ? 1UL << k : 0, (2UL << k) - 1,
+			line);
+	}
+	for(unsigned i = 0; i < m.doneSiteCount; i++){
+		const HeapSite &s = m.doneSites[i];
+		int len = snprintf(line, sizeof(line), "site %u: ", s.site);
+		printHeapCount(line + len, sizeof(line) - len, s.counts);
+		printSite(fp, line, s.site);
+	}
+	fprintf(fp, "end\n");
+	if(!out)
+		fclose(fp);
+	__sync_lock_release(&g_heapSnapshotLock);
+	return true;
+}
+
+// Invoked by monitor No.0 after each round.
+static void heapProfPoll(void){
+	static unsigned lastUs;
+	unsigned now = getUsTime();
+	if(!lastUs)
+		lastUs = now;
+	if(now - lastUs < g_heapProfMs * 1000)
+		return;
+	lastUs = now;
+	heapSnapshot("period");
+}
+
+}//namespace cruiser
+
+#endif //HEAPPROF_H
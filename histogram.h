@@ -0,0 +1,99 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+namespace cruiser{
+
+#define HIST_SUB_BITS		3
+#define HIST_SUB			(1u << HIST_SUB_BITS)
+// Values are 32 bits; see Histogram::bucketOf().
+#define HIST_BUCKETS		((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// A log-bucketed histogram, as in HdrHistogram: each power-of-two range of
+// values is split into HIST_SUB linear buckets, so a bucket is at most 1/8
+// of its values wide, whatever the magnitude, in 240 counters. Values below
+// HIST_SUB have a bucket each.
+//
+// It is written by one thread, without synchronization; a reader of another
+// thread may see it a few records behind. It is POD, so that the histograms
+// can be static.
+struct Histogram{
+	unsigned long	counts[HIST_BUCKETS];
+	unsigned long	total;
+	unsigned long	sum; // Of the values, for the mean
+	unsigned		max;
+
+	static unsigned bucketOf(unsigned v){
+		if(v < HIST_SUB)
+			return v;
+		// v >> shift is in [HIST_SUB, 2 * HIST_SUB).
+		unsigned shift = 31 - __builtin_clz(v) - HIST_SUB_BITS;
+		return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+	}
+
+	// The largest value that falls into bucket @b.
+	static unsigned long bucketHigh(unsigned b){
+		if(b < HIST_SUB)
+			return b;
+		unsigned shift = b / HIST_SUB - 1;
+		return ((unsigned long)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+	}
+
+	void record(unsigned v){
+		counts[bucketOf(v)]++;
+		total++;
+		sum += v;
+		if(v > max)
+			max = v;
+	}
+
+	void add(const Histogram &h){
+		for(unsigned b = 0; b < HIST_BUCKETS; b++)
+			counts[b] += h.counts[b];
+		total += h.total;
+		sum += h.sum;
+		if(h.max > max)
+			max = h.max;
+	}
+
+	// The value below which a fraction @q of the records fall, rounded up to
+	// the top of its bucket (but not beyond the maximum), so it errs on the
+	// high side by less than 1/8.
+	unsigned long percentile(double q) const{
+		if(!total)
+			return 0;
+		unsigned long rank = (unsigned long)(q * total);
+		if(rank < q * total || rank < 1)
+			rank++;
+		unsigned long seen = 0;
+		for(unsigned b = 0; b < HIST_BUCKETS; b++){
+			seen += counts[b];
+			if(seen >= rank)
+				return bucketHigh(b) < max ? bucketHigh(b) : max;
+		}
+		return max;
+	}
+};
+
+}//namespace cruiser
+
+#endif //HISTOGRAM_H
@@ -0,0 +1,143 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef LEAKS_H
+#define LEAKS_H
+
+#include <sys/mman.h> // mmap
+#include "heapprof.h"
+#include "stats_page.h"
+
+namespace cruiser{
+
+// CRUISER_LEAKS=<rounds>: leak suspicion from the ages of the buffers. The
+// monitor stamps a node with its round at the first check
+// (CruiserNode::stamp) and, in the rounds after, counts the buffer as old
+// once it has survived <rounds> rounds (see HeapProfile::add()). The stamp
+// is one of the node tags of -DNODE_TAGS, which CRUISER_LEAKS needs; it
+// shares the field with the latency stamp, and the user buffer is not
+// touched more than the check does.
+//
+// Every <rounds> rounds of monitor No.0 is a checkpoint: the old bytes of each
+// size class, and of each site with CRUISER_SITES, are compared with those of
+// the last checkpoint. A class or a site whose old bytes have grown at each of
+// the last LEAK_CHECKPOINTS checkpoints is a suspect: buffers keep being
+// allocated there and kept. A cache that fills up and then stays flat is not.
+// The suspects with the most growth are published in the stats page
+// (CRUISER_STATS=1; see cruiser-top -l).
+
+#define LEAK_CHECKPOINTS		3
+
+struct LeakTrend{
+	unsigned		checkpoint; // The last checkpoint it was updated at
+	unsigned		streak; // Checkpoints in a row with growth
+	unsigned long	lastBytes; // Old bytes at the last checkpoint
+	unsigned long	baseBytes; // Old bytes before the streak
+};
+
+static LeakTrend				g_leakClasses[HEAP_CLASSES];
+static LeakTrend				*g_leakSites; // Indexed by site ID
+static unsigned					g_leakCheckpoint;
+static unsigned					g_leakCount;
+static StatsLeak				g_leaks[STATS_LEAKS];
+
+// Sets up the trends of the sites; invoked by init(), after siteInit().
+static void leakInit(void){
+	if(!g_leakRounds || !g_siteDepth)
+		return;
+	void *p = mmap(NULL, (SITE_TABLE_SIZE + 1) * sizeof(LeakTrend),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0);
+	if(p != MAP_FAILED)
+		g_leakSites = (LeakTrend*)p;
+}
+
+// Updates @t with the @bytes of the checkpoint. Returns true if they make a
+// suspect.
+static bool leakTrend(LeakTrend &t, unsigned long bytes){
+	if(t.checkpoint && t.checkpoint + 1 == g_leakCheckpoint && 
+			bytes > t.lastBytes)
+		t.streak++;
+	else{
+		t.streak = 0;
+		t.baseBytes = bytes;
+	}
+	t.checkpoint = g_leakCheckpoint;
+	t.lastBytes = bytes;
+	return t.streak >= LEAK_CHECKPOINTS;
+}
+
+// Adds @leak to g_leaks if it is among the STATS_LEAKS with the most growth.
+static void leakSuspect(const StatsLeak &leak){
+	unsigned i = g_leakCount < STATS_LEAKS ? g_leakCount++ : STATS_LEAKS;
+	for(; i > 0 && g_leaks[i - 1].growth < leak.growth; i--){
+		if(i < STATS_LEAKS)
+			g_leaks[i] = g_leaks[i - 1];
+	}
+	if(i < STATS_LEAKS)
+		g_leaks[i] = leak;
+}
+
+static void leakCheckpoint(void){
+	while(__sync_lock_test_and_set(&g_heapSnapshotLock, 1))
+		cpuRelax();
+	unsigned long rounds;
+	if(!heapMerge(rounds)){
+		__sync_lock_release(&g_heapSnapshotLock);
+		return;
+	}
+	const HeapProfile &m = g_heapMerge;
+	g_leakCheckpoint++;
+	g_leakCount = 0;
+	for(unsigned k = 0; k < HEAP_CLASSES; k++){
+		const HeapCount &c = m.doneClasses[k];
+		LeakTrend &t = g_leakClasses[k];
+		if(!leakTrend(t, c.oldBytes))
+			continue;
+		StatsLeak leak = {0, t.streak, k ? 1UL << k : 0, (2UL << k) - 1, 0,
+			c.oldCount, c.oldBytes, c.oldBytes - t.baseBytes};
+		leakSuspect(leak);
+	}
+	for(unsigned i = 0; g_leakSites && i < m.doneSiteCount; i++){
+		const HeapSite &s = m.doneSites[i];
+		LeakTrend &t = g_leakSites[s.site];
+		if(!leakTrend(t, s.counts.oldBytes))
+			continue;
+		StatsLeak leak = {s.site, t.streak, 0, 0, g_sites[s.site - 1].pcs[0],
+			s.counts.oldCount, s.counts.oldBytes,
+			s.counts.oldBytes - t.baseBytes};
+		leakSuspect(leak);
+	}
+	__sync_lock_release(&g_heapSnapshotLock);
+}
+
+// Invoked by monitor No.0 after each round.
+static void leakPoll(void){
+	static unsigned lastRound;
+	unsigned round = g_heapProfiles[0].round;
+	if(round - lastRound < g_leakRounds)
+		return;
+	lastRound = round;
+	leakCheckpoint();
+}
+
+}//namespace cruiser
+
+#endif //LEAKS_H
@@ -64,7 +64,7 @@ public:
 	RingT(unsigned preFilled){
 		assert(preFilled < ringSize);
 		for(unsigned int i = 0; i < preFilled; i++){
-			array[i] = (T*) original_malloc(sizeof(T));
+			array[i] = (T*) g_arena.allocate(sizeof(T));
 		}
 		pi = pi_current = pi_snapshot = preFilled;
 		ci = ci_current = ci_snapshot = ci_batch = pi_batch = 0;
@@ -143,7 +143,7 @@ public:
 	bool insert(const CruiserNode & node){
 		ListNode* pn;
 		if(!ring.consume(pn))
-			pn = (ListNode*)original_malloc( sizeof(ListNode) );
+			pn = (ListNode*)g_arena.allocate( sizeof(ListNode) );
 		assert(pn);
 		pn->cn = node;
 		do{
@@ -153,6 +153,16 @@ public:
 	}
 	
 	int traverse( int (*pfn)(const CruiserNode &) );
+
+	// Slicing is not supported by this list; a whole round is traversed.
+	int traverse( int (*pfn)(const CruiserNode &), unsigned ){
+		return traverse(pfn);
+	}
+
+	void visit( void (*pfn)(const CruiserNode &) ){
+		for(ListNode *cur = dummy.next; cur != NULL; cur = cur->next)
+			pfn(cur->cn);
+	}
 };
 
 int List::traverse( int (*pfn)(const CruiserNode &) ){
@@ -189,7 +199,7 @@ again:
 					if( bFirst ){
 						if( __sync_bool_compare_and_swap(&dummy.next, cur, next) ){
 							if(!ring.produce(cur))
-								original_free(cur);
+								g_arena.deallocate(cur, sizeof(ListNode));
 						}
 						// No matter the deletion succeeded or not, traverse 
 						// again. Otherwise, the "prev" variable may not point to 
@@ -200,7 +210,7 @@ again:
 						assert(prev->next == cur);
 						prev->next = next;
 						if(!ring.produce(cur))
-							original_free(cur);
+							g_arena.deallocate(cur, sizeof(ListNode));
 						cur = next;
 					}
 					break;
@@ -227,11 +237,16 @@ private:
 	RingT<ListNode, LIST_RING_SIZE>	ring;
 	
 	ListNode 		dummy; 
+
+	// Where a sliced traverse stopped: the last node kept in the list, or
+	// NULL if a new round is to begin. It stays valid between the slices, as
+	// nodes are only removed by the traverse and inserted at the head.
+	ListNode		*cursor;
 	
 public:	
 	#define PRE_ALLOCATED_FACTION 0
 	
-	List():ring(PRE_ALLOCATED_FACTION * LIST_RING_SIZE){
+	List():ring(PRE_ALLOCATED_FACTION * LIST_RING_SIZE), cursor(NULL){
 		dummy.next = NULL;
 		dummy.cn.userAddr = NULL;
 	}
@@ -239,7 +254,7 @@ public:
 	bool insert(const CruiserNode & node){
 		ListNode* pn;
 		if(!ring.consume(pn))
-			pn = (ListNode*)original_malloc( sizeof(ListNode) );
+			pn = (ListNode*)g_arena.allocate( sizeof(ListNode) );
 		assert(pn);
 		pn->cn = node;
 		pn->next = dummy.next;
@@ -247,32 +262,54 @@ public:
 		return true;
 	}
 	
-	int traverse( int (*pfn)(const CruiserNode &) );
+	int traverse( int (*pfn)(const CruiserNode &) ){
+		return traverse(pfn, 0);
+	}
+
+	int traverse( int (*pfn)(const CruiserNode &), unsigned budget);
+
+	// The nodes marked deleted are left for the traverse to remove.
+	void visit( void (*pfn)(const CruiserNode &) ){
+		for(ListNode *cur = dummy.next; cur != NULL; cur = cur->next){
+			if(!cur->isMarkedDelete())
+				pfn(cur->cn);
+		}
+	}
 };
 
-int List::traverse( int (*pfn)(const CruiserNode &) ){
+int List::traverse( int (*pfn)(const CruiserNode &), unsigned budget){
 	ListNode *prev, *cur, *next;
-	cur = dummy.next;
-	if(!cur)
-		return 1;
-	if(!cur->isMarkedDelete()){
-		// pfn Return values:
-		// 	0: to stop monitoring (obsolete);
-		//	1: have checked one node
-		//	2: have encountered a dummy node (should never happen)
-		//	3: a node is to be removed
-		if(pfn(cur->cn) == 3)
-			cur->markDelete();
+	unsigned visited = 0;
+	if(cursor){
+		prev = cursor;
+	}else{
+		cur = dummy.next;
+		if(!cur)
+			return 1;
+		if(!cur->isMarkedDelete()){
+			// pfn Return values:
+			// 	0: to stop monitoring (obsolete);
+			//	1: have checked one node
+			//	2: have encountered a dummy node (should never happen)
+			//	3: a node is to be removed
+			if(pfn(cur->cn) == 3)
+				cur->markDelete();
+		}
+		prev = cur;
+		visited++;
 	}
 	
-	prev = cur;
-	cur = cur->next;
+	cur = prev->next;
 	while(NULL != cur){
+		if(budget && visited++ >= budget){
+			cursor = prev;
+			return 2;
+		}
 		next = cur->next;
 		if(cur->isMarkedDelete()){
 			prev->next = next;
 			if(!ring.produce(cur))
-				original_free(cur);//delete cur;	
+				g_arena.deallocate(cur, sizeof(ListNode));
 		}else{
 			switch(pfn(cur->cn)){
 				// As the "stop monitoring" feature may be exploited,
@@ -289,7 +326,7 @@ int List::traverse( int (*pfn)(const CruiserNode &) ){
 				case 3:
 					prev->next = next;
 					if(!ring.produce(cur))
-						original_free(cur);
+						g_arena.deallocate(cur, sizeof(ListNode));
 					break;
 				default:
 					break;
@@ -297,9 +334,62 @@ int List::traverse( int (*pfn)(const CruiserNode &) ){
 		}
 		cur = next;
 	}
+	cursor = NULL;
 	return 1;
 }
 #endif //CRUISER_OLD_LIST
 
+// With multiple transmitters, each one inserts into its own shard, as a List
+// only supports one inserting thread. The monitor traverses the shards in 
+// turn.
+class ContainerGroup:public NodeContainer{
+private:
+	NodeContainer	*shards[MAX_TRANSMITTERS];
+	unsigned		count;
+	unsigned		current; // The shard being traversed by slices
+
+public:
+	ContainerGroup():count(0), current(0){}
+
+	~ContainerGroup(){
+		for(unsigned i = 0; i < count; i++)
+			delete shards[i];
+	}
+
+	void add(NodeContainer *shard){
+		assert(count < MAX_TRANSMITTERS);
+		shards[count++] = shard;
+	}
+
+	NodeContainer* getShard(unsigned i){return shards[i];}
+
+	// Transmitters insert into their shards directly; this is only for
+	// callers that do not know about shards.
+	bool insert(const CruiserNode & node){
+		return shards[0]->insert(node);
+	}
+
+	int traverse( int (*pfn)(const CruiserNode &) ){
+		for(unsigned i = 0; i < count; i++)
+			shards[i]->traverse(pfn);
+		return 1;
+	}
+
+	void visit( void (*pfn)(const CruiserNode &) ){
+		for(unsigned i = 0; i < count; i++)
+			shards[i]->visit(pfn);
+	}
+
+	// The end of each shard is also a section boundary.
+	int traverse( int (*pfn)(const CruiserNode &), unsigned budget){
+		if(shards[current]->traverse(pfn, budget) == 2)
+			return 2;
+		if(++current < count)
+			return 2;
+		current = 0;
+		return 1;
+	}
+};
+
 }//namespace cruiser
 #endif //LIST_H
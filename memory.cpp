@@ -23,6 +23,9 @@
 #include <sys/mman.h> // mmap, munmap
 #include <string.h>
 #include "monitor.h"
+#ifdef CRUISER_VARIANT
+#include "variant.h"
+#endif
 
 // It is insufficient to avoid global namespace pollution solely by declaring
 // all functions static; classe and structure names are still polluting.
@@ -30,10 +33,18 @@
 namespace cruiser{
 
 void beforeExit(void);
+static void forkPrepare(void);
+static void forkParent(void);
+static void forkChild(void);
 
 // Retrieve original memory allocation function addresses and create cruiser
-// threads. The constructor function is invoked automatically by libc.
+// threads. The constructor function is invoked automatically by libc; in
+// libcruiser.so, dispatch.cpp calls the init() of the selected mode instead.
+#ifdef CRUISER_VARIANT
+void init(){
+#else
 void __attribute__((constructor)) init(){
+#endif
 	// If SELinux is involved, a malloc call would be issued before the
 	// automatic init call, so we have to initialize explicitly in our malloc:
 	// "if(!g_initialized) init();" // if is redundant; it is for better perf.
@@ -77,6 +88,7 @@ void __attribute__((constructor)) init(){
 #ifdef DELAYED
 		g_canary_free = 0xfefefedd; //0xfedcba98;
 		g_canary_realloc = 0x10101010;
+		g_canary_unmonitored = 0x5a5a5a5a;
 #endif //DELAYED
 	//}
 
@@ -128,45 +140,66 @@ void __attribute__((constructor)) init(){
 		return;
 #endif //SPEC
 
+	const char *strPolicy = getenv("CRUISER_RING_FULL");
+	if(strPolicy){
+		if(!strcmp(strPolicy, "spin"))
+			g_ring_full_policy = RING_SPIN;
+		else if(!strcmp(strPolicy, "overflow"))
+			g_ring_full_policy = RING_OVERFLOW;
+		else if(!strcmp(strPolicy, "bypass"))
+			g_ring_full_policy = RING_BYPASS;
+		else
+			g_ring_full_policy = RING_GROW;
+	}
+	g_ring_spin_count = getEnvInt("CRUISER_RING_SPIN", g_ring_spin_count);
+	int transmitters = getEnvInt("CRUISER_TRANSMITTERS", 1);
+	if(transmitters < 1)
+		transmitters = 1;
+	else if(transmitters > MAX_TRANSMITTERS)
+		transmitters = MAX_TRANSMITTERS;
+	g_txPerNode = g_transmitterCount = transmitters;
+	g_fused = getEnvInt("CRUISER_FUSED", 0);
+	if(g_fused)
+		g_txPerNode = g_transmitterCount = 1;
+	int slice = getEnvInt("CRUISER_FUSED_SLICE", g_fused_slice);
+	if(slice > 0)
+		g_fused_slice = slice;
+#ifdef RING_BATCH
+	g_publish_us = getEnvInt("CRUISER_PUBLISH_US", g_publish_us);
+#endif
+#ifdef DELAYED
+	g_assist_us = getEnvInt("CRUISER_ASSIST_MS", 0) * 1000;
+#endif
+	g_statsEnabled = getEnvInt("CRUISER_STATS", 0);
+	eventLogInit();
+	siteInit();
+	heapProfInit();
+	leakInit();
+	controlInit();
+
 	if(t_protect){
 		t_protect = 0;
-		if(!g_threadrecordlist)
+		if(!g_threadrecordlist){
 			g_threadrecordlist = new ThreadRecordList;
+			pthread_key_create(&g_threadRecordKey, threadRecordExit);
+		}
+		if(g_ring_full_policy == RING_OVERFLOW && !g_overflowRing)
+			g_overflowRing = new OverflowRing;
 		t_protect = 1;
 	}
 
 	// NMONITOR: hook the malloc/free call and encapsulate the buffer; but
 	//			the monitor and transmitter threads are not created.
 	// NPROTECT: hook malloc/free merely (t_protect = 0).
-#ifndef NMONITOR
-	// Create the monitor thread, which will creates the transmitter thread
-	int thread_ret = pthread_create(&g_monitor, NULL, monitor, NULL);
-	if(thread_ret){
-		fprintf(stderr, "Error: monitor thread cannote be created (%d)\n",
-				thread_ret);
-		exit(-1);
-	}
-#endif
-
-	// fopen calls malloc, so
-	// this has to be after the original_malloc family is retrieved;
-	// otherwise, there will be segfault.
-#if defined(EXP) || defined(SINGLE_EXP)
-	FILE *fp = fopen("cruiser.log", "a");
-	if(!fp)
-		fp = stderr;
-#ifdef DELAYED
-	const char *str = "Lazy";
+#ifdef NMONITOR
+	g_started = 1;
 #else
-	const char *str = "Eager";
+	g_start_calls = getEnvInt("CRUISER_START_CALLS", g_start_calls);
+	g_start_us = getEnvInt("CRUISER_START_MS", g_start_us / 1000) * 1000;
 #endif
-	fprintf(fp, "\n\n\n%s Cruiser(pid %lu, thread ID %lu), program:%s at %u\n",
-			str, (unsigned long)g_pid, (unsigned long)pthread_self(),
-			program_invocation_name, g_init_begin_time );
-	fprintf(fp, "init time %u us\n", getUsTime() - g_init_begin_time);
-	if(fp != stderr)
-		fclose(fp);
-#endif //defined(EXP) || defined(SINGLE_EXP)
+
+	g_init_us = getUsTime() - g_init_begin_time;
+	logEvent(EVENT_INIT, g_pid, g_init_us);
 
 #ifdef CRUISER_DEBUG
 	fprintf(stderr, "Init is finished by the main thread %lu\n",
@@ -179,10 +212,120 @@ void __attribute__((constructor)) init(){
 
 	if(atexit(beforeExit))
 		fprintf(stderr, "Error: atexit(beforeExit) failed");
+	if(pthread_atfork(forkPrepare, forkParent, forkChild))
+		fprintf(stderr, "Error: pthread_atfork failed");
+#ifdef CRUISER_PROFILE
+	profileInit();
+#endif
 
-	// cruiser threads won't start real monitoring until g_initialized == 2,
-	// in order to let init() finish first. This may be unnecessary.
 	g_initialized = 2;
+
+#ifndef NMONITOR
+	createMonitor();
+#endif
+}
+
+// fork() is handled in all builds. Before fork(), the user threads leave
+// assist(), the cruiser threads are paused at a safe point and the arena lock
+// is taken, so that the child gets consistent cruiser data. In the child, only the forking thread exists: the
+// records of the other threads are marked exited, so that the new 
+// transmitters drain and then release them, and the cruiser threads are
+// started again, lazily as at the beginning; a child that calls exec() soon
+// thus never sets up the transmitters.
+static void forkPrepare(void){
+	pthread_mutex_lock(&g_startMutex); // No start in the meantime
+	if(g_started == 1)
+		return;
+#ifdef DELAYED
+	// An assisting thread frees a buffer in processNode() before the list
+	// unlinks its node; the child must not get the list in between. As at
+	// exit, no thread begins to assist from now on, and those assisting are
+	// waited for; the monitor may then be paused in the middle of a slice,
+	// as it is only paused between two nodes.
+	g_forking = 1;
+	__sync_synchronize();
+	waitForAssists(NULL);
+#endif
+	// Each loop of a cruiser thread reaches a safe point (between two nodes
+	// while it drains or checks) or sleeps as idle, so the pause comes; a
+	// child forked before it would copy rings and lists in the middle of an
+	// update. Keep waiting rather than fork anyway.
+	while(!pauseCruiserThreads(PAUSE_WAIT_US))
+		;
+	while(__sync_lock_test_and_set(&g_arena.lock, 1))
+		cpuRelax();
+}
+
+static void forkParent(void){
+	if(g_started != 1){
+		__sync_lock_release(&g_arena.lock);
+		resumeCruiserThreads();
+#ifdef DELAYED
+		g_forking = 0;
+#endif
+	}
+	pthread_mutex_unlock(&g_startMutex);
+}
+
+static void forkChild(void){
+	pthread_mutex_init(&g_startMutex, NULL);
+	pthread_cond_init(&g_startCond, NULL);
+	pthread_mutex_init(&g_pauseMutex, NULL);
+	pthread_cond_init(&g_pauseCond, NULL);
+	if(g_started == 1)
+		return;
+	// The lock holders, if any, do not exist in the child.
+	g_arena.lock = 0;
+#ifdef DELAYED
+	g_traverseLock = 0;
+	g_assist_wanted = 0;
+	// Threads that were about to see g_forking and leave assist()
+	g_assistingThreads = 0;
+	g_forking = 0;
+#endif
+#ifdef EXP
+	g_statsLock = 0;
+#endif
+	g_pausePending = 0;
+	g_pausedThreads = g_cruiserThreads = 0;
+	// The page is the parent's; the monitor of the child creates its own.
+	if(g_statsPage){
+		munmap(g_statsPage, sizeof(StatsPage));
+		g_statsPage = NULL;
+	}
+	pid_t parent = g_pid;
+	g_pid = getpid();
+
+	pthread_t self = pthread_self();
+	for(ThreadRecord *p = g_threadrecordlist->head; p != NULL; p = p->next){
+		p->consuming = 0;
+		if(p->threadID && !pthread_equal(p->threadID, self))
+			p->exited = 1;
+	}
+
+	eventsAfterFork();
+	controlAfterFork();
+	g_heapSnapshotLock = 0;
+	g_threadStatsLock = 0;
+	logEvent(EVENT_FORK, parent, g_pid);
+#ifdef EXP
+	if(!g_eventLogKB){
+		FILE *fp = openTextLog();
+		fprintf(fp, "Process fork detected %s, parent %lu, child %lu\n",
+			program_invocation_name, (unsigned long)parent,
+			(unsigned long)g_pid);
+		closeTextLog(fp);
+	}
+#endif
+
+	if(g_exit_procedure != RUNNING){
+		g_started = 1;
+		return;
+	}
+	g_started = 0;
+	g_startCalls = 0;
+	g_init_begin_time = getUsTime();
+	createMonitor();
 }
 
 // Some programs, e.g. tar, don't call beforeExit at exit.
@@ -191,9 +334,15 @@ void __attribute__((constructor)) init(){
 void beforeExit(void){
 #ifdef EXP
 	unsigned endTime = getUsTime();
-	FILE *fp = fopen("cruiser.log", "a");
-	if (!fp)
-		fp = stderr;
+	FILE *fp = openTextLog();
+#ifdef DELAYED
+	const char *str = "Lazy";
+#else
+	const char *str = "Eager";
+#endif
+	fprintf(fp, "\n\n\n%s Cruiser(pid %lu), program:%s at %u\n", str,
+		(unsigned long)g_pid, program_invocation_name, g_init_begin_time);
+	fprintf(fp, "init time %u us\n", g_init_us);
 	fprintf(fp, "\nBefore exit program:%s (pid %lu, thread id %lu)\n",
 		program_invocation_name,
 		(unsigned long)getpid(),
@@ -225,6 +374,7 @@ void beforeExit(void){
 	unsigned totalProduced = 0;
 	//unsigned totalSize = 0;
 	unsigned totalDropped = 0;
+	unsigned totalFallback = 0;
 	unsigned totalConsumed = 0;
 	int i = 0;
 	ThreadRecord *p;
@@ -233,37 +383,76 @@ void beforeExit(void){
 		totalRingSize	+= p->pr->getSize();
 		totalProduced	+= p->pCount;
 		//totalSize	+= p->pSize;
-		totalDropped	+= p->pDropped;
+		totalDropped	+= p->stats.drops;
+		totalFallback	+= p->pFallback;
 		totalConsumed	+= p->cCount;
 		fprintf(fp, "Thread record NO.%d: threadID %lu, ringSize %u, produced \
-			%u, dropped %u, consumed %u\n",
+			%u, dropped %u, fallback %u, consumed %u\n",
 			i+1, (unsigned long)(p->threadID), p->pr->getSize(), p->pCount,
-			p->pDropped, p->cCount);
+			(unsigned)p->stats.drops, p->pFallback, p->cCount);
 	}
 	fprintf(fp, "Total ring size %u, total allocated %u chunks, dropped %u, \
-		transmitted %u\n",
-		totalRingSize, totalProduced, totalDropped, totalConsumed);
+		fallback %u, transmitted %u\n",
+		totalRingSize, totalProduced, totalDropped, totalFallback,
+		totalConsumed);
+	ThreadStats stats;
+	g_threadrecordlist->sumStats(stats);
+	fprintf(fp, "Allocated %lu buffers, %lu bytes, freed %lu buffers (%lu \
+		delayed), ring grows %lu, drops %lu\n", stats.mallocs, stats.bytes,
+		stats.frees, stats.delayed, stats.grows, stats.drops);
+	if(g_numaNodes > 1){
+		for(unsigned n = 0; n < g_numaNodes; n++)
+			fprintf(fp, "Node %u: monitor round %lu, avg round %.2f us, max \
+				round %u us\n", n, g_nodeRoundCount[n], g_nodeRoundCount[n] ?
+				g_nodeRoundUs[n] / double(g_nodeRoundCount[n]) : 0.0,
+				g_nodeMaxRoundUs[n]);
+	}
+	const char *histogramNames[] = {"Round wall time (us)", 
+		"Round CPU time (us)", "Buffers per round", "Detection latency (us)"};
+	Histogram RoundHistograms::*histograms[] = {&RoundHistograms::wallUs,
+		&RoundHistograms::cpuUs, &RoundHistograms::buffers,
+		&RoundHistograms::latencyUs};
+	for(unsigned k = 0; k < 4; k++){
+		StatsPercentiles s;
+		summarize(histograms[k], s);
+		fprintf(fp, "%s: count %lu, p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+			histogramNames[k], s.count, s.p50, s.p99, s.p999, s.max);
+	}
 #endif // EXP
 
 
 #ifdef SINGLE_EXP
-	fprintf(fp, "malloc %u, realloc %u, calloc %u, free %u\n",
-		g_malloc_count, g_realloc_count, g_calloc_count, g_free_count);
+	fprintf(fp, "malloc %lu, realloc %lu, calloc %lu, free %lu\n",
+		stats.mallocs - stats.callocs - stats.reallocs, stats.reallocs,
+		stats.callocs, stats.frees);
 #endif
 
 #ifdef EXP
-	if(fp != stderr)
-		fclose(fp); // Any output to the file should be before this line
+	closeTextLog(fp); // Any output to the file should be before this line
+#endif
+
+#ifdef CRUISER_PROFILE
+	dumpProfile("exit");
 #endif
+	if(g_heapProfMs)
+		heapSnapshot("exit");
+
+	if(g_eventLogKB && g_threadrecordlist){
+		ThreadStats total;
+		g_threadrecordlist->sumStats(total);
+		unsigned long rounds = 0;
+		for(unsigned n = 0; n < g_numaNodes; n++)
+			rounds += g_nodeRoundCount[n];
+		logEvent(EVENT_EXIT, total.mallocs, total.frees, rounds);
+	}
+	drainEvents(true);
 
 	// Set the flag to notify the deliver/monitor threads to end.
 	g_exit_procedure = EXIT_HOOKED;
+	closeStatsPage();
 
 #ifdef MONITOR_EXIT
-	unsigned int waitBegin = getUsTime();
-	while(g_exit_procedure != MONITOR_DONE &&
-			(getUsTime() - waitBegin < 1000000U) )
-		sleep(0);
+	finalCheck();
 #endif
 }
 
@@ -301,6 +490,7 @@ inline void afterMalloc(void* addr, size_t word_size){
 	fprintf( stderr, "In afterMalloc, thread ID %lu, to protect real addr %p, \
 			word_size %lu\n", (unsigned long)(pthread_self()), addr, word_size);
 #endif
+	PROFILE_BEGIN(encapsulateBegin);
 
 	// Encapsulate the buffer
 	unsigned long *p = (unsigned long *)addr;
@@ -324,20 +514,63 @@ inline void afterMalloc(void* addr, size_t word_size){
 	node.userAddr = p + 2;
 	node.ID = p[0];
 #endif
-	if(__builtin_expect(!t_threadRecord, 0)){
+	// Read once, as each access to a thread-local variable of a shared 
+	// library is a call.
+	ThreadRecord *record = t_threadRecord;
+	if(__builtin_expect(!record, 0)){
 		// For mallocs in init() before "new g_threadrecordlist" is executed.
 		// It is probably uncecessary, just in case
 		if(__builtin_expect(!g_threadrecordlist, 0))
 			return;
-		t_threadRecord = g_threadrecordlist->getThreadRecord();
-		if(!t_threadRecord)
+		record = t_threadRecord = g_threadrecordlist->getThreadRecord();
+		if(!record)
 			return;
 	}
+	record->stats.mallocs++;
+	record->stats.bytes += word_size * sizeof(long);
+#ifdef NODE_TAGS
+	node.site = g_siteDepth ? captureSite(record) : 0;
+	node.stamp = 0;
+	// The clock is only read for the sample.
+	if(__builtin_expect(++record->stampTick >= g_latencySample, 0)){
+		record->stampTick = 0;
+		node.stamp = (getUsTime() & ~STAMP_BIRTH) | 1;
+	}
+#endif
+	PROFILE_END(record, PROFILE_ENCAPSULATE, encapsulateBegin);
+
+	PROFILE_BEGIN(produceBegin);
+	bool produced = record->produce(node);
+	PROFILE_END(record, PROFILE_PRODUCE, produceBegin);
+	if(__builtin_expect(!produced, 0)){
+#ifdef DELAYED
+		// The monitor will never see the buffer, so it would never be freed;
+		// mark it so that free() checks and releases it directly.
+		p[0] = g_canary_unmonitored ^ word_size;
+#endif
+	}
+}
+
+#ifdef DELAYED
+// Is the buffer (raw address @p) one that the monitor does not know about?
+inline static bool isUnmonitored(unsigned long *p){
+	return p[0] == (g_canary_unmonitored ^ p[1]);
+}
+#endif
 
-	t_threadRecord->produce(node);
+// Counts a call in the statistics of the calling thread, whose record is 
+// @record. A thread that has never allocated has no record yet, so its frees
+// go to g_strayStats.
+inline static void countCall(ThreadRecord *record, 
+		unsigned long ThreadStats::*counter){
+	if(__builtin_expect(record != NULL, 1))
+		(record->stats.*counter)++;
+	else
+		__sync_fetch_and_add(&(g_strayStats.*counter), 1);
 }
 
-inline static void beforeFree(void* addr){
+// Returns true if the buffer is left to the monitor to release.
+inline static bool beforeFree(void* addr){
 	unsigned long *p = (unsigned long*)addr - 2;
 #ifdef DELAYED
 
@@ -345,18 +578,26 @@ inline static void beforeFree(void* addr){
 	if(__builtin_expect(p[0] == g_canary_free ^ p[1], 0)){
 		fprintf(stderr, "Duplicate frees are detected\n");
 		//todo: set error no.
-		return;
+		return false;
 	}
 #endif // CHECK_DUPLICATE_FREES
 
+	if(__builtin_expect(isUnmonitored(p), 0)){
+		if(p[2 + p[1]] != (g_canary ^ p[1]))
+			attackDetected(addr, 1);
+		original_free(p);
+		return false;
+	}
+
 	p[0] ^= (g_canary ^ g_canary_free); // p[0] = size_word ^ g_canary_free
+	return true;
 
 #else // NOT DELAYTED
 
 #ifdef CHECK_DUPLICATE_FREES
 	if(!p[0]){
 		fprintf(stderr, "Duplicate frees are detected\n");
-		return true;
+		return false;
 	}
 #endif // CHECK_DUPLICATE_FREES
 
@@ -366,6 +607,7 @@ inline static void beforeFree(void* addr){
 		attackDetected(addr, 1);
 	}
 	p[0] = 0;
+	return false;
 
 #endif // DELAYED
 }
@@ -382,10 +624,7 @@ static void* malloc_wrapper(size_t size){
 #endif
 		return p;
 	}
-
-#ifdef SINGLE_EXP
-	g_malloc_count++;
-#endif
+	PROBE1(malloc, size);
 
 	// Adjust the size so that the location for canary is word alignmet.
 	// For example, in 32-bit syste, if the user requested size is 11,
@@ -401,6 +640,12 @@ static void* malloc_wrapper(size_t size){
 	if(__builtin_expect(!addr, 0))
 		return NULL;
 	afterMalloc(addr, word_size);
+	if(__builtin_expect(!g_started, 0))
+		startPoll();
+#ifdef DELAYED
+	if(__builtin_expect(g_assist_wanted, 0))
+		assist();
+#endif
 	return (long*)addr + 2;
 }
 
@@ -429,50 +674,37 @@ static void free_wrapper(void* addr){
 		original_free(addr);
 		return;
 	}
-
-	// The logic dealing with fork() is put here rather than malloc,
-	// because malloc is too heavy.
-#ifdef APACHE
-	pid_t  g_pid_copy = g_pid;
-	pid_t  current_pid = getpid();
-	if(__builtin_expect(g_pid_copy != current_pid, 0)){
-		if(__sync_bool_compare_and_swap(&g_pid, g_pid_copy, current_pid)){
-#ifdef EXP
-			FILE *fp = fopen("cruiser.log", "a");
-			if (!fp)
-				fp = stderr;
-			fprintf(fp, "Process fork detected %s, parent %lu, child %lu\n",
-				program_invocation_name, (unsigned long)g_pid_copy,
-				(unsigned long)g_pid);
-			if(fp!=stderr)
-				fclose(fp);
-#endif
-			g_init_begin_time = getUsTime();
-			g_exit_procedure = RUNNING;
-			// Create the monitor thread, which will create the transmitter
-			int thread_ret = pthread_create(&g_monitor, NULL, monitor, NULL);
-			if(thread_ret){
-				fprintf(stderr, "Error: monitor thread cannote be created, \
-					return value is %d\n", thread_ret);
-				exit(-1);
-			}
-		}
-	}
-#endif //APACHE
-
-#ifdef SINGLE_EXP
-	g_free_count++;
+	PROBE1(free, addr);
+
+	// Read once, as each access to a thread-local variable of a shared 
+	// library is a call.
+	ThreadRecord *record = t_threadRecord;
+	countCall(record, &ThreadStats::frees);
+
+#ifdef RING_BATCH
+	// Publish the pending batch, so that the monitor gets to check (and, for
+	// lazy-cruiser, release) the buffers without waiting for the timer.
+	if(record)
+		record->flush();
 #endif
 
-
 #ifdef CRUISER_DEBUG
 	fprintf( stderr, "real addr %p will be freed (after check) protected by \
 			%lu\n\n", (long*)addr - 2, (unsigned long)(pthread_self()));
 #endif
-	beforeFree(addr);
+	PROFILE_BEGIN(freeBegin);
+	bool delayed = beforeFree(addr);
+	PROFILE_END(record, PROFILE_FREE, freeBegin);
+	if(delayed)
+		countCall(record, &ThreadStats::delayed);
+	if(__builtin_expect(!g_started, 0))
+		startPoll();
 
 #ifndef DELAYED
 	original_free( (unsigned long*)addr - 2);
+#else
+	if(__builtin_expect(g_assist_wanted, 0))
+		assist();
 #endif //DELAYED
 	return;
 }
@@ -480,6 +712,7 @@ static void free_wrapper(void* addr){
 static void* realloc_wrapper(void *addr, size_t new_size){
 	if( __builtin_expect(!t_protect, 0) )
 		return original_realloc(addr, new_size);
+	PROBE2(realloc, addr, new_size);
 
 	if(__builtin_expect(!new_size, 0)){
 		free_wrapper(addr);
@@ -489,13 +722,6 @@ static void* realloc_wrapper(void *addr, size_t new_size){
 	if(__builtin_expect(!addr, 0))
 		return malloc_wrapper(new_size);
 
-	// The accounting logic is put here because if it is before the lines above,
-	// then when new_size == 0 or addr ==0, the accounting would be duplicate
-	// with that in free or malloc
-#ifdef SINGLE_EXP
-	g_realloc_count++;
-#endif
-
 #ifdef CRUISER_DEBUG
 	fprintf( stderr, "realloc from user addr %p by %lu size = %lu t_protect \
 		= %d\n", addr, (unsigned long)(pthread_self()), new_size, t_protect);
@@ -511,7 +737,7 @@ static void* realloc_wrapper(void *addr, size_t new_size){
 	if(word_size == new_word_size){
 		return addr;
 	}
-	else if(word_size > new_size){
+	else if(word_size > new_size && !isUnmonitored((unsigned long*)p)){
 		// Set the realloc flag, which is observed by the monitor;
 		// A more secure flag: p[0] = p[0] ^ g_canary ^ g_canary_realloc
 		p[0] = g_canary_realloc;
@@ -520,11 +746,12 @@ static void* realloc_wrapper(void *addr, size_t new_size){
 		p[0] = (volatile unsigned long)(g_canary ^ new_word_size);
 		return addr;
 	}
-	else{ // word_size < new_size
+	else{ // word_size < new_size, or the buffer is unmonitored
 		// Different from the free logic which simply call beforeFree to change
 		// p[0], realloc needs to use word_size , so it has to make sure
 		// word_size is not corrupted
-		if(__builtin_expect(p[0] != (g_canary ^ word_size), 0)){
+		if(__builtin_expect(p[0] != (g_canary ^ word_size) &&
+				!isUnmonitored((unsigned long*)p), 0)){
 			fprintf(stderr, "Attack info: addr(user) %p, p[0] 0x%lx, p[1] 0x%lx\
 				,p[end] 0x%lx, expected_canary 0x%lx, canary_free 0x%lx",
 				addr, p[0], p[1], p[2 + word_size], g_canary ^ word_size,
@@ -532,26 +759,41 @@ static void* realloc_wrapper(void *addr, size_t new_size){
 			attackDetected(addr, 2);
 			return NULL;
 		}
+		PROFILE_BEGIN(copyBegin);
 		unsigned long* new_buffer = (unsigned long*)original_malloc(
 			(new_word_size + EXTRA_WORDS) * sizeof(long));
 		if(__builtin_expect(!new_buffer, 0))
 			return NULL;
 		memcpy(new_buffer+2, addr, (word_size < new_word_size ? word_size :
 			new_word_size) * sizeof(long));
+		// Ends here: afterMalloc() records its own stages.
+		PROFILE_END(t_threadRecord, PROFILE_REALLOC_COPY, copyBegin);
 		afterMalloc(new_buffer, new_word_size);
-		beforeFree(addr);
+		// Counted with afterMalloc() only, as ThreadStats::mallocs is; the
+		// new_size == 0 and addr == 0 cases are counted by free and malloc.
+		countCall(t_threadRecord, &ThreadStats::reallocs);
+		PROFILE_BEGIN(freeBegin);
+		bool delayed = beforeFree(addr);
+		PROFILE_END(t_threadRecord, PROFILE_FREE, freeBegin);
+		if(delayed)
+			countCall(t_threadRecord, &ThreadStats::delayed);
 		return new_buffer + 2;
 	}
 
 #else  //not DELAYED
 	// Call beforeFree to check the buffer and change the buffer ID, so that
 	// the monitor thread will delete the corresponding cruiser node.
+	PROFILE_BEGIN(freeBegin);
 	beforeFree(addr);
+	PROFILE_END(t_threadRecord, PROFILE_FREE, freeBegin);
+	PROFILE_BEGIN(copyBegin);
 	unsigned long *new_buffer = (unsigned long*)original_realloc(
 		(unsigned long*)addr - 2, (new_word_size + EXTRA_WORDS) * sizeof(long));
+	PROFILE_END(t_threadRecord, PROFILE_REALLOC_COPY, copyBegin);
 	if(__builtin_expect(!new_buffer, 0))
 		return NULL;
 	afterMalloc(new_buffer, new_word_size);
+	countCall(t_threadRecord, &ThreadStats::reallocs); // As in lazy-cruiser
 	return new_buffer + 2;
 #endif //DELAYED
 }
@@ -593,19 +835,22 @@ static void* calloc_wrapper(size_t nobj, size_t size){
 		return original_calloc(nobj, size);
 	}
 
-#if defined(SINGLE_EXP)
-	g_calloc_count++;
-#endif
-
 	void *p = original_calloc(word_size + EXTRA_WORDS, sizeof(long));
 	if(__builtin_expect(!p, 0))
 		return NULL;
 	afterMalloc(p, word_size);
+	countCall(t_threadRecord, &ThreadStats::callocs);
 	return (long*)p + 2;
 }
 
+#ifdef CRUISER_VARIANT
+extern const CruiserVariant g_variant = {CRUISER_VARIANT, init, 
+	malloc_wrapper, free_wrapper, realloc_wrapper, calloc_wrapper};
+#endif
+
 }//namespace cruiser
 
+#ifndef CRUISER_VARIANT
 extern "C"{
 // The reason I don't use _malloc_hook is that you need to recover the original
 // hook to call the real malloc, which is not thread-safe.
@@ -642,3 +887,4 @@ void* calloc(size_t nobj, size_t size){
 // }
 
 }//extern "C"
+#endif //CRUISER_VARIANT
@@ -28,6 +28,7 @@
 #include <dlfcn.h> //dlsym
 #include <setjmp.h> //siglongjmp
 #include <time.h> //nanosleep
+#include <fcntl.h> //open
 // Note that this hook cannot be used to achieve initialization because it can
 // be overridden by user code. Besides, when __malloc_initialize_hook is invoked
 // is implementation dependent, e.g. it may not be called until "malloc" is
@@ -41,11 +42,20 @@
 //#else
 #include "list.h"
 //#endif
+#include "pacer.h"
+#include "thread_control.h"
+#include "stats_page.h"
+#include "events.h"
+#include "sites.h"
+#include "heapprof.h"
+#include "leaks.h"
+#include "control.h"
 
 namespace cruiser{
 static void* monitor(void *);
 static void* transmitter(void*);
 static int processNode(const CruiserNode &);
+static int verifyNode(const CruiserNode &, size_t *);
 //static void beforeExit(void); move to thread_record.h
 //static void SIGSEGV_handler(int signo);
 
@@ -97,15 +107,15 @@ static int processNode(const CruiserNode &);
 // may still access the memory, the access may lead to the SIGSEGV signal.
 // The handler is used to handle the signal.
 static void SIGSEGV_handler(int signo){
-	if(pthread_self() == g_monitor){
+	if(t_isMonitor){
 #ifdef CRUISER_DEBUG
 		fprintf(stderr, "SIGSEGV is caught\n");
 #endif
 
 #ifdef EXP
-		g_signalBufferCount++;
+		t_signalBufferCount++;
 #endif
-		siglongjmp(g_jmp, 1);
+		siglongjmp(t_jmp, 1);
 	}
 	else{
 		// TODO: at the moment, SIGSEGV is masked so even we raise SIGSEGV,
@@ -118,81 +128,31 @@ static void SIGSEGV_handler(int signo){
 }
 #endif //DELAYED
 
-void* monitor(void *){ // "void* foo(void)" interface for a thread function.
-	// malloc/free calls issued by the monitor thread should not be hooked??
-	t_protect = 0;
-#ifdef CRUISER_DEBUG
-	fprintf( stderr, "Monitor thread id: %lu\n",
-		(unsigned long)(pthread_self()));
-#endif
-	if(!g_nodeContainer){
-//#ifdef AMINO_HASHTABLE
-//		g_nodeContainer = new Hashtable;
-		//ASSERT(g_nodeContainer);
-//#else
-		g_nodeContainer = new List;
-//#endif
-	}
-
-	int roundMsSleep = -1;
-	char *strMsSleep = getenv("CRUISER_SLEEP");
-	if(strMsSleep)
-		roundMsSleep = atoi(strMsSleep);
-
-	g_transmitter_still_count = 0;
-	if(int thread_ret = pthread_create(&g_transmitter, NULL, transmitter, NULL)){
-		fprintf(stderr, "Error: transmitter thread cannote be created, return \
-						value is %d\n", thread_ret);
-		delete g_nodeContainer;
-		exit(-1);
-	}
-
-	while(g_initialized != 2)
-		sleep(0);
-
-#ifdef EXP
-	pid_t processID = getpid();
-	pthread_t threadID = pthread_self();
-	FILE *fp = fopen("cruiser.log", "a");
-	if (!fp)
-		fp = stderr;
-
-	fprintf(fp, "Monitor thread:%s (pid %lu, tid %lu), init duration %u\n",
-			program_invocation_name, (unsigned long)processID,
-			(unsigned long)threadID, getUsTime() - g_init_begin_time);
-	fflush(fp);
-#endif //EXP
-
-	// If no buffer is released in the last round, staticCount++;
-	// if its value is larger than SLEEP_CONDITION, go to sleep
-	// TODO: consider a better indicator for going asleep
-	unsigned staticCount = 0;
-	#define SLEEP_CONDITION 10
+// If the transmitter finds no node in SLEEP_CONDITION passes in a row, it
+// sleeps briefly before the next pass.
+#define SLEEP_CONDITION 10
 
-#ifdef DELAYED	//VERY LONG
+// The thread CPU time when the round began.
+static __thread unsigned long long	t_roundCpuBegin;
 
-#ifdef EXP
-	g_roundCount = g_totalCheckCount = 0;
-	g_maxRoundBufferCount = g_avgRoundBufferCount = 0;
-	g_avgLiveBufferCount = g_avgLiveBufferSize = 0;
-	g_maxLiveBufferCount = g_maxLiveBufferSize = 0;
-	g_avgDelayedBufferCount = g_avgDelayedBufferSize = 0;
-	g_maxDelayedBufferCount = g_maxDelayedBufferSize = 0;
-#endif //EXP
-
-
-#ifdef SINGLE_EXP
-	g_malloc_count = g_free_count = g_calloc_count = g_realloc_count = 0;
+// Called before each round of traverse.
+inline static void beginRound(void){
+	PROBE0(round_begin);
+	t_roundCpuBegin = getNsTime(CLOCK_THREAD_CPUTIME_ID);
+	t_roundBufferCount = 0;
+#ifdef DELAYED
+	t_roundBufferSize = 0;
+	t_delayedBufferCount = t_delayedBufferSize = 0;
+#else
+	t_liveBufferCount = t_liveBufferSize = 0;
 #endif
+}
 
-	// Recall the return values of NodeContainer::traverse():
-	//	0: to stop monitor (the feature is not enabled to avoid exploit).
-	//	1: finished one round of traverse.
-	//	2: encountered the section boundary (not used).
-
-	// The coding style is a little bit ugly, just I don't want to write
-	// "g_delayedBufferCount = 0" multiple times inside the loop body.
-	while((g_delayedBufferCount = 0, g_nodeContainer->traverse(processNode))){
+// Called after each round of traverse to update the statistics.
+// Returns true if no buffer was released in the round, which means that the
+// program is rather inactive.
+static bool endRound(void){
+#ifdef DELAYED
 //#ifdef EXP
 //		unsigned int nodeContainerLen = 0;
 //		if(g_totalCheckCount != lastTotalCheckCount){
@@ -205,84 +165,685 @@ void* monitor(void *){ // "void* foo(void)" interface for a thread function.
 //#endif
 
 #ifdef EXP
-		if(g_roundBufferCount){
-			//total
-			g_roundCount++;
-			g_totalCheckCount += g_roundBufferCount;
-			if(g_roundBufferCount > g_maxRoundBufferCount)
-				g_maxRoundBufferCount = g_roundBufferCount;
-			g_avgRoundBufferCount = ((g_roundCount - 1) * g_avgRoundBufferCount
-									+ g_roundBufferCount) / g_roundCount;
-
-			//live
-			unsigned liveBufferCount = g_roundBufferCount - g_delayedBufferCount;
-			unsigned liveBufferSize = g_roundBufferSize - g_delayedBufferSize;
-			g_avgLiveBufferCount = ((g_roundCount - 1) * g_avgLiveBufferCount
-									+ liveBufferCount) / g_roundCount;
-			g_avgLiveBufferSize = ((g_roundCount - 1) * g_avgLiveBufferSize
-									+ liveBufferSize) / g_roundCount;
-			if(liveBufferCount > g_maxLiveBufferCount){
-				g_maxLiveBufferCount = liveBufferCount;
-			}
-			if(liveBufferSize > g_maxLiveBufferSize)
-				g_maxLiveBufferSize = liveBufferSize;
-
-			//delayed
-			g_avgDelayedBufferCount = ((g_roundCount - 1) *
-				g_avgDelayedBufferCount + g_delayedBufferCount) / g_roundCount;
-			g_avgDelayedBufferSize = ((g_roundCount - 1) *
-				g_avgDelayedBufferSize + g_delayedBufferSize) / g_roundCount;
-			if(g_delayedBufferCount > g_maxDelayedBufferCount)
-				g_maxDelayedBufferCount = g_delayedBufferCount;
-			if(g_delayedBufferSize > g_maxDelayedBufferSize)
-				g_maxDelayedBufferSize = g_delayedBufferSize;
+	while(__sync_lock_test_and_set(&g_statsLock, 1))
+		cpuRelax();
+	if(t_roundBufferCount){
+		//total
+		g_roundCount++;
+		g_totalCheckCount += t_roundBufferCount;
+		if(t_roundBufferCount > g_maxRoundBufferCount)
+			g_maxRoundBufferCount = t_roundBufferCount;
+		g_avgRoundBufferCount = ((g_roundCount - 1) * g_avgRoundBufferCount
+								+ t_roundBufferCount) / g_roundCount;
+
+		//live
+		unsigned liveBufferCount = t_roundBufferCount - t_delayedBufferCount;
+		unsigned liveBufferSize = t_roundBufferSize - t_delayedBufferSize;
+		g_avgLiveBufferCount = ((g_roundCount - 1) * g_avgLiveBufferCount
+								+ liveBufferCount) / g_roundCount;
+		g_avgLiveBufferSize = ((g_roundCount - 1) * g_avgLiveBufferSize
+								+ liveBufferSize) / g_roundCount;
+		if(liveBufferCount > g_maxLiveBufferCount){
+			g_maxLiveBufferCount = liveBufferCount;
 		}
+		if(liveBufferSize > g_maxLiveBufferSize)
+			g_maxLiveBufferSize = liveBufferSize;
+
+		//delayed
+		g_avgDelayedBufferCount = ((g_roundCount - 1) *
+			g_avgDelayedBufferCount + t_delayedBufferCount) / g_roundCount;
+		g_avgDelayedBufferSize = ((g_roundCount - 1) *
+			g_avgDelayedBufferSize + t_delayedBufferSize) / g_roundCount;
+		if(t_delayedBufferCount > g_maxDelayedBufferCount)
+			g_maxDelayedBufferCount = t_delayedBufferCount;
+		if(t_delayedBufferSize > g_maxDelayedBufferSize)
+			g_maxDelayedBufferSize = t_delayedBufferSize;
+	}
 
 //#ifdef APACHE
-		//fprintf(fp, "Monitor thread:%s (pid %u, thread id %u), \
-		// g_roundCount %u, duration %u\n", program_invocation_name, processID,
-		// threadID, g_roundCount, getUsTime() - g_init_begin_time);
-		//fflush(fp);
+	//fprintf(fp, "Monitor thread:%s (pid %u, thread id %u), \
+	// g_roundCount %u, duration %u\n", program_invocation_name, processID,
+	// threadID, g_roundCount, getUsTime() - g_init_begin_time);
+	//fflush(fp);
 //#endif //APACHE
 
-		g_delayedBufferSize = g_roundBufferCount = g_roundBufferSize = 0;
+	__sync_lock_release(&g_statsLock);
 #endif //EXP
 
+	return !t_delayedBufferCount;
+
+#else //DELAYED
+
+#ifdef EXP
+	while(__sync_lock_test_and_set(&g_statsLock, 1))
+		cpuRelax();
+	if(t_roundBufferCount){
+		// The size statistics below is commented out, because the size
+		// field may have been corrupted, so the information is inaccurate.
+
+		//total
+		g_roundCount++;
+		g_totalCheckCount += t_roundBufferCount;
+		if(t_roundBufferCount > g_maxRoundBufferCount)
+			g_maxRoundBufferCount = t_roundBufferCount;
+		g_avgRoundBufferCount = ((g_roundCount - 1) * g_avgRoundBufferCount
+								+ t_roundBufferCount) / g_roundCount;
+
+		//live
+		g_avgLiveBufferCount = ((g_roundCount - 1) * g_avgLiveBufferCount
+								+ t_liveBufferCount) / g_roundCount;
+		//g_avgLiveBufferSize = ((g_roundCount - 1) * g_avgLiveBufferSize
+		//						+ liveBufferSize) / g_roundCount;
+		if(t_liveBufferCount > g_maxLiveBufferCount)
+			g_maxLiveBufferCount = t_liveBufferCount;
+		//if(liveBufferSize > g_maxLiveBufferSize)
+		//	g_maxLiveBufferSize = liveBufferSize;
+
+		//buffers that trigger SIGSEGV signals
+		g_avgSignalBufferCount = ((g_roundCount - 1) *
+			g_avgSignalBufferCount + t_signalBufferCount) / g_roundCount;
+		//g_avgDelayedBufferSize = ((g_roundCount - 1) *
+		//	g_avgDelayedBufferSize + t_delayedBufferSize) / g_roundCount;
+		if(t_signalBufferCount > g_maxSignalBufferCount)
+			g_maxSignalBufferCount = t_signalBufferCount;
+		//if(t_delayedBufferSize > g_maxDelayedBufferSize)
+		//	g_maxDelayedBufferSize = t_delayedBufferSize;
+	}
+	__sync_lock_release(&g_statsLock);
+	t_signalBufferCount = 0;
+#endif //EXP
+
+	static __thread unsigned long lastLiveCount = 0;
+	bool still = (lastLiveCount == t_liveBufferCount);
+	lastLiveCount = t_liveBufferCount;
+	return still;
+#endif //DELAYED
+}
+
+#ifdef DELAYED
+// Traverses a slice of g_nodeContainer from the shared position. If @wait is
+// false and another thread is traversing, returns -1 right away.
+static int sharedTraverse(unsigned budget, bool wait){
+	while(__sync_lock_test_and_set(&g_traverseLock, 1)){
+		if(!wait)
+			return -1;
+		cpuRelax();
+	}
+	int ret = g_nodeContainer->traverse(processNode, budget);
+	if(ret == 1){
+		g_roundsDone++;
+		// The round may have been finished by any of the threads.
+		if(t_heapProfile)
+			t_heapProfile->close();
+	}
+	__sync_lock_release(&g_traverseLock);
+	return ret;
+}
+
+// Called by the user threads in malloc/free while the monitor lags behind.
+// The buffers released by processNode go to original_free, and any report
+// it prints must not be hooked, hence t_protect = 0.
+// At exit, no thread begins to assist once g_exit_procedure has moved on, and
+// finalCheck() waits for those already assisting to leave; forkPrepare() does
+// the same with g_forking. The last one to leave then wakes the waiter up.
+static void assist(void){
+	__sync_add_and_fetch(&g_assistingThreads, 1);
+	if(g_exit_procedure == RUNNING && !g_forking){
+		int protect = t_protect;
+		t_protect = 0;
+		t_heapProfile = g_heapCounting ? &g_heapProfiles[0] : NULL;
+		sharedTraverse(ASSIST_BUDGET, false);
+		t_heapProfile = NULL;
+		t_protect = protect;
+	}
+	if(!__sync_sub_and_fetch(&g_assistingThreads, 1) && 
+			(g_exit_procedure != RUNNING || g_forking))
+		notifyPause();
+}
+
+// Waits until no thread is in assist(), until @deadline at most if it is not
+// NULL; g_exit_procedure or g_forking must have been set first. Returns true
+// if no thread is.
+static bool waitForAssists(const struct timespec *deadline){
+	pthread_mutex_lock(&g_pauseMutex);
+	while(g_assistingThreads){
+		if(!deadline)
+			pthread_cond_wait(&g_pauseCond, &g_pauseMutex);
+		else if(pthread_cond_timedwait(&g_pauseCond, &g_pauseMutex, 
+				deadline) == ETIMEDOUT)
+			break;
+	}
+	bool done = !g_assistingThreads;
+	pthread_mutex_unlock(&g_pauseMutex);
+	return done;
+}
+#endif //DELAYED
+
+// The monitor's sliced traverse of @container. With assist, the round
+// may also be finished by the user threads, so the round is over when
+// g_roundsDone moves rather than when our own slice reaches the end.
+static int monitorTraverse(NodeContainer *container, unsigned budget){
+#ifdef DELAYED
+	if(g_assist_us){
+		static unsigned long	round;
+		static unsigned			roundBegin;
+		if(!roundBegin)
+			roundBegin = getUsTime();
+		sharedTraverse(budget ? budget : ASSIST_MONITOR_SLICE, true);
+		if(g_roundsDone == round){
+			if(!g_assist_wanted && getUsTime() - roundBegin >= g_assist_us)
+				g_assist_wanted = 1;
+			return 2;
+		}
+		round = g_roundsDone;
+		roundBegin = getUsTime();
+		g_assist_wanted = 0;
+		return 1;
+	}
+#endif //DELAYED
+	return container->traverse(processNode, budget);
+}
+
+// Traverses @container for one round; in slices, if the pacer or the assist
+// is on.
+static int traverseRound(NodeContainer *container){
+	bool sliced = t_pacer.enabled();
+#ifdef DELAYED
+	sliced = sliced || g_assist_us;
+#endif
+	if(!sliced)
+		return container->traverse(processNode);
+	int ret;
+	if(t_pacer.enabled())
+		t_pacer.beginRound();
+	do{
+		if(t_pacer.enabled())
+			t_pacer.beginSlice();
+		ret = monitorTraverse(container, 
+			t_pacer.enabled() ? t_pacer.getBudget() : 0);
+		if(t_pacer.enabled())
+			t_pacer.endSlice();
+	}while(ret == 2);
+	return ret;
+}
+
+// Drains the rings of the thread records assigned to transmitter No. @me into
+// @shard once. Returns the number of nodes transmitted. With RING_BATCH, 
+// @flush makes it pick up the unpublished entries regardless of the time.
+static unsigned long transmitPass(unsigned me, NodeContainer *shard,
+		bool flush = false){
+	bool				shared = (g_transmitterCount > 1);
+	unsigned long 		count = 0;
+	unsigned long		recordCount;
+	CruiserNode 		node;
+#ifdef RING_BATCH
+	unsigned			now = getUsTime();
+	static unsigned		lastSync[MAX_TRANSMITTERS];
+	bool sync = flush || (now - lastSync[me] >= g_publish_us);
+	if(sync)
+		lastSync[me] = now;
+#endif
+	ThreadRecord *p;
+	for(p = g_threadrecordlist->head; p != NULL; p = p->next){
+		if( !p->threadID )
+			continue;
+		if(shared && (p->shard != me || 
+				!__sync_bool_compare_and_swap(&p->consuming, 0, 1)))
+			continue;
+#ifdef RING_BATCH
+		if(sync)
+			p->cr->syncProducer();
+#endif
+		// Read "exited" before consuming, so that an empty ring means
+		// everything the thread produced has been drained.
+		int exited = p->exited;
+		__sync_synchronize();
+		if(!p->consume(node)){
+			if(exited){
+				p->exited = 0;
+				__sync_synchronize();
+				p->threadID = 0; // The record can be reused now
+			}
+		}else{
+			recordCount = 0;
+			do{
+				ASSERT(node.userAddr);
+				recordCount++;
+				if(node.userAddr)//Actually no need to judge, just in case.
+					shard->insert(node);
+				// A long backlog must not hold up a pause: stop draining the
+				// record here and pause once it is released below, so that
+				// finalCheck() can drain the rest of it.
+			}while(!pauseWanted() && p->consume(node));
+			count += recordCount;
+			p->transmitted += recordCount;
+		}
+		if(shared)
+			__sync_lock_release(&p->consuming);
+		safePoint();
+	}
+	// Nodes that did not fit into their full rings (RING_OVERFLOW).
+	if(me == 0 && g_overflowRing){
+		while(g_overflowRing->consume(node)){
+			count++;
+			shard->insert(node);
+			safePoint();
+		}
+	}
+	if(count){
+		__sync_add_and_fetch(&g_transmittedCount, count);
+		PROBE2(tx_batch, me, count);
+	}
+	return count;
+}
+
+// Lets the parked fused monitor notice new allocations.
+static void fusedPoll(void){
+	transmitPass(0, g_shards[0]);
+}
+
+// CRUISER_STATS: the stats page (see stats_page.h) of the process, updated by
+// monitor No.0.
+#define STATS_PERIOD_US			100000
+static bool						g_statsEnabled;
+static StatsPage				*g_statsPage;
+static unsigned					g_lastRoundUs; // Of monitor No.0
+
+// Creates the page under a temporary name and renames it into place, so that
+// a reader never finds it half initialized. /dev/shm is writable by all, so
+// the temporary name is a fresh one from mkostemp() (O_EXCL, mode 0600), and
+// rename() replaces whatever is at the final name rather than following it;
+// the page is only readable by the user of the process. Returns false on
+// failure.
+static bool openStatsPage(void){
+	char path[64], tmp[72];
+	snprintf(path, sizeof(path), STATS_PAGE_PATH, (int)getpid());
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if(fd < 0)
+		return false;
+	StatsPage *page = (StatsPage*)MAP_FAILED;
+	if(ftruncate(fd, sizeof(StatsPage)) == 0)
+		page = (StatsPage*)mmap(NULL, sizeof(StatsPage), 
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(page == MAP_FAILED){
+		unlink(tmp);
+		return false;
+	}
+	page->magic = STATS_PAGE_MAGIC;
+	page->version = STATS_PAGE_VERSION;
+	page->size = sizeof(StatsPage);
+	page->pid = getpid();
+#ifdef DELAYED
+	strcpy(page->mode, "lazy");
+#else
+	strcpy(page->mode, "eager");
+#endif
+	page->startUs = wallUsTime();
+	if(rename(tmp, path) != 0){
+		munmap(page, sizeof(StatsPage));
+		unlink(tmp);
+		return false;
+	}
+	g_statsPage = page;
+	return true;
+}
+
+// Removes the page at exit; a reader that has it mapped keeps the last 
+// figures.
+static void closeStatsPage(void){
+	if(!g_statsPage)
+		return;
+	char path[64];
+	snprintf(path, sizeof(path), STATS_PAGE_PATH, (int)getpid());
+	unlink(path);
+}
+
+// Sums up histogram @which of all the monitors into @out; @sum, if given, gets
+// the sum of the values.
+static void summarize(Histogram RoundHistograms::*which, StatsPercentiles &out,
+		unsigned long *sum = NULL){
+	Histogram h;
+	memset(&h, 0, sizeof(h));
+	for(unsigned n = 0; n < g_numaNodes; n++)
+		h.add(g_nodeHistograms[n].*which);
+	out.count = h.total;
+	out.p50 = h.percentile(0.5);
+	out.p99 = h.percentile(0.99);
+	out.p999 = h.percentile(0.999);
+	out.max = h.max;
+	if(sum)
+		*sum = h.sum;
+}
+
+// Fills the figures of @page (those under the seqlock but "seq") from the
+// thread statistics @stats; for the stats page and the control socket
+// (control.h). @sums, if given, gets the sums of the four histograms.
+static void fillStats(StatsPage &page, const ThreadStats &stats,
+		unsigned long *sums){
+	unsigned threads = 0;
+	unsigned long backlog = 0, transmitted = 0, fallbacks = 0;
+	for(ThreadRecord *p = g_threadrecordlist->head; p != NULL; p = p->next){
+		if(p->threadID)
+			threads++;
+		// Read without synchronization, so the difference may be off by a
+		// few nodes.
+		long queued = (long)(p->stats.mallocs - p->stats.drops - 
+			p->pFallback - p->transmitted);
+		if(queued > 0)
+			backlog += queued;
+		transmitted += p->transmitted;
+		fallbacks += p->pFallback;
+	}
+	unsigned long rounds = 0;
+	unsigned maxRoundUs = 0;
+	RoundFigures last = {0, 0, 0, 0, 0};
+	for(unsigned n = 0; n < g_numaNodes; n++){
+		rounds += g_nodeRoundCount[n];
+		if(g_nodeMaxRoundUs[n] > maxRoundUs)
+			maxRoundUs = g_nodeMaxRoundUs[n];
+		last.buffers += g_nodeLastRound[n].buffers;
+		last.liveBuffers += g_nodeLastRound[n].liveBuffers;
+		last.liveBytes += g_nodeLastRound[n].liveBytes;
+		last.delayedBuffers += g_nodeLastRound[n].delayedBuffers;
+		last.delayedBytes += g_nodeLastRound[n].delayedBytes;
+	}
+
+	page.threads = threads;
+	page.updateUs = wallUsTime();
+	page.rounds = rounds;
+	page.lastRoundUs = g_lastRoundUs;
+	page.maxRoundUs = maxRoundUs;
+	page.listLength = last.buffers;
+	page.liveBuffers = last.liveBuffers;
+	page.liveBytes = last.liveBytes;
+	page.delayedBuffers = last.delayedBuffers;
+	page.delayedBytes = last.delayedBytes;
+	page.ringBacklog = backlog;
+	page.transmitted = transmitted;
+	page.mallocs = stats.mallocs;
+	page.frees = stats.frees;
+	page.bytes = stats.bytes;
+	page.grows = stats.grows;
+	page.drops = stats.drops;
+	page.fallbacks = fallbacks;
+	summarize(&RoundHistograms::wallUs, page.roundWallUs, sums);
+	summarize(&RoundHistograms::cpuUs, page.roundCpuUs, sums ? sums + 1 : 0);
+	summarize(&RoundHistograms::buffers, page.roundBuffers, 
+		sums ? sums + 2 : 0);
+	summarize(&RoundHistograms::latencyUs, page.sampledLatencyUs,
+		sums ? sums + 3 : 0);
+	page.leakRounds = g_leakRounds;
+	page.leakCount = g_leakCount;
+	memcpy(page.leaks, g_leaks, sizeof(g_leaks));
+	page.siteOverflows = g_siteOverflows;
+}
+
+// Invoked by monitor No.0 after each round.
+static void publishStats(void){
+	static unsigned lastUs;
+	unsigned now = getUsTime();
+	if(g_statsPage && now - lastUs < STATS_PERIOD_US)
+		return;
+	lastUs = now;
+	// No page is created once the exit has begun, as it would be left behind.
+	if(!g_statsPage && (g_exit_procedure != RUNNING || !openStatsPage())){
+		g_statsEnabled = false;
+		return;
+	}
+
+	StatsPage *page = g_statsPage;
+	page->seq++;
+	__sync_synchronize();
+	fillStats(*page, g_threadStats, NULL);
+	__sync_synchronize();
+	page->seq++;
+}
+
+#ifdef CRUISER_PROFILE
+// Appends the cycles each stage has added so far, summed over all the 
+// threads, to cruiser.log; @why tells what triggered the dump.
+static void dumpProfile(const char *why){
+	Profile sum;
+	memset(&sum, 0, sizeof(sum));
+	for(ThreadRecord *p = g_threadrecordlist ? g_threadrecordlist->head : NULL;
+			p != NULL; p = p->next){
+		for(unsigned s = 0; s < PROFILE_STAGES; s++)
+			sum.stages[s].add(p->profile.stages[s]);
+	}
+	unsigned long long ticks = readTsc() - g_profileTsc0;
+	double nsPerTick = ticks ? 
+		(getNsTime(CLOCK_MONOTONIC) - g_profileNs0) / double(ticks) : 0;
+	// The cost of PROFILE_BEGIN/PROFILE_END themselves, included in every
+	// figure below.
+	unsigned long long overhead = ~0ULL;
+	for(int i = 0; i < 100; i++){
+		unsigned long long t = readTsc();
+		t = readTsc() - t;
+		if(t < overhead)
+			overhead = t;
+	}
+
+	FILE *fp = openTextLog();
+	fprintf(fp, "\nProfile (%s) of %s (pid %lu): cycles per call, %.3f ns per \
+cycle, %llu cycles of timer overhead included\n", why, program_invocation_name,
+		(unsigned long)getpid(), nsPerTick, overhead);
+	for(unsigned s = 0; s < PROFILE_STAGES; s++){
+		const Histogram &h = sum.stages[s];
+		double mean = h.total ? h.sum / double(h.total) : 0;
+		fprintf(fp, "%-12s count %lu, mean %.1f (%.1f ns), p50 %lu, p99 %lu, \
+p999 %lu, max %u\n", g_profileStageNames[s], h.total, mean, mean * nsPerTick,
+			h.percentile(0.5), h.percentile(0.99), h.percentile(0.999), h.max);
+	}
+	closeTextLog(fp);
+}
+#endif //CRUISER_PROFILE
+
+// Records the duration and the figures of a round of the monitor of @node.
+// Monitor No.0 also sums up the thread statistics and updates the stats page.
+inline static void roundTime(unsigned node, unsigned us){
+	PROBE3(round_end, node, us, t_roundBufferCount);
+	RoundHistograms &h = g_nodeHistograms[node];
+	h.wallUs.record(us);
+	h.cpuUs.record((getNsTime(CLOCK_THREAD_CPUTIME_ID) - t_roundCpuBegin) 
+		/ 1000);
+	h.buffers.record(t_roundBufferCount);
+	g_nodeRoundCount[node]++;
+	g_nodeRoundUs[node] += us;
+	if(us > g_nodeMaxRoundUs[node])
+		g_nodeMaxRoundUs[node] = us;
+	RoundFigures &last = g_nodeLastRound[node];
+	last.buffers = t_roundBufferCount;
+#ifdef DELAYED
+	last.liveBuffers = t_roundBufferCount - t_delayedBufferCount;
+	last.liveBytes = (unsigned long)(t_roundBufferSize - t_delayedBufferSize)
+		* sizeof(long);
+	last.delayedBuffers = t_delayedBufferCount;
+	last.delayedBytes = (unsigned long)t_delayedBufferSize * sizeof(long);
+#else
+	last.liveBuffers = t_liveBufferCount;
+	last.liveBytes = (unsigned long)t_liveBufferSize * sizeof(long);
+#endif
+#ifdef DELAYED
+	if(t_heapProfile && !g_assist_us) // Otherwise see sharedTraverse().
+#else
+	if(t_heapProfile)
+#endif
+		t_heapProfile->close();
+	if(node == 0){
+		ThreadStats stats;
+		g_threadrecordlist->sumStats(stats);
+		while(__sync_lock_test_and_set(&g_threadStatsLock, 1))
+			cpuRelax();
+		g_threadStats = stats;
+		__sync_lock_release(&g_threadStatsLock);
+		g_lastRoundUs = us;
+		if(g_statsEnabled)
+			publishStats();
+		drainEvents(false);
+		if(g_heapProfMs)
+			heapProfPoll();
+		if(g_leakRounds)
+			leakPoll();
+#ifdef CRUISER_PROFILE
+		if(g_profileDump){
+			g_profileDump = 0;
+			dumpProfile("SIGUSR1");
+		}
+#endif
+	}
+}
+
+// Reads the controls of the monitors; see g_controlSeq.
+static void readMonitorControls(void){
+	char *strMsSleep = getenv("CRUISER_SLEEP");
+	if(strMsSleep)
+		g_roundMsSleep = atoi(strMsSleep);
+	g_cpuShare = getEnvInt("CRUISER_CPU_SHARE", 0);
+	g_maxRoundMs = getEnvInt("CRUISER_MAX_ROUND_MS", 0);
+	g_maxLatencyMs = getEnvInt("CRUISER_MAX_LATENCY_MS", SCHED_MAX_LATENCY_MS);
+}
+
+// Applies the controls to the monitor of @node, at its start and between two
+// rounds.
+static void applyMonitorControls(unsigned node){
+	t_controlSeq = g_controlSeq;
+	// The CPU budget supersedes CRUISER_SLEEP.
+	t_pacer.configure(g_cpuShare, g_maxRoundMs);
+	// So does CRUISER_SLEEP the adaptive inter-round delay.
+	t_scheduler.configure(g_roundMsSleep != -1 ? 0 : g_maxLatencyMs);
+	if(node == 0)
+		g_parkIdle = t_scheduler.enabled();
+}
+
+// The end of the exit procedure, when the cruiser threads make their own last
+// pass and round; finalCheck() waits for it if they cannot be paused.
+static pthread_mutex_t			g_exitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			g_exitDone = PTHREAD_COND_INITIALIZER;
+
+static void exitProcedureDone(void){
+	pthread_mutex_lock(&g_exitMutex);
+	g_exit_procedure = MONITOR_DONE;
+	pthread_cond_broadcast(&g_exitDone);
+	pthread_mutex_unlock(&g_exitMutex);
+}
+
+// CRUISER_FUSED: a single cruiser thread alternates between draining the rings
+// and checking a slice of the list. It keeps draining while the rings have a
+// backlog (a pass moves at least a slice of nodes), but at most 
+// FUSED_MAX_PASSES times, so that the traverse always makes progress; when
+// the rings are quiet, it checks bigger slices to finish the round sooner.
+static void fusedMonitor(void){
+	NodeContainer	*shard = g_shards[0];
+	bool			transmitting = true;
+	unsigned long	count = 0;
+	unsigned		roundBegin = getUsTime();
+
+	beginRound();
+	if(t_pacer.enabled())
+		t_pacer.beginRound();
+	while(true){
+		safePoint();
+		if(t_pacer.enabled())
+			t_pacer.beginSlice();
+		if(transmitting){
+			unsigned passes = 0;
+			do{
+				count = transmitPass(0, shard);
+			}while(count >= g_fused_slice && ++passes < FUSED_MAX_PASSES);
+
+			if(g_exit_procedure == EXIT_HOOKED){
+				while(transmitPass(0, shard))
+					;
+				g_exit_procedure = TRANSMITTER_DONE;
+				transmitting = false;
+			}
+		}
+
+		unsigned budget = (count >= g_fused_slice) ? g_fused_slice :
+			g_fused_slice * FUSED_QUIET_FACTOR;
+		if(t_pacer.enabled())
+			budget = t_pacer.getBudget();
+		int ret = monitorTraverse(g_nodeContainer, budget);
+		if(t_pacer.enabled())
+			t_pacer.endSlice();
+		if(ret != 1)
+			continue;
+
+		unsigned roundUs = getUsTime() - roundBegin;
+		roundTime(0, roundUs);
+		if(g_boostUs)
+			boostIfLagging(roundUs > g_boostUs || count >= BOOST_BACKLOG);
+		bool still = endRound();
+		if(t_controlSeq != g_controlSeq)
+			applyMonitorControls(0);
+		beginRound();
+		roundBegin = getUsTime();
+		if(t_pacer.enabled())
+			t_pacer.beginRound();
 
-//#ifdef MONITOR_EXIT
-		// The purpose is to perform one more round of traverse at exit.
-		// It is critical to ensure checking the last second overflow.
 		if(g_exit_procedure == TRANSMITTER_DONE){
 			g_exit_procedure = MONITOR_BEGIN;
 			continue;
 		}else if(g_exit_procedure == MONITOR_BEGIN){
-			g_exit_procedure = MONITOR_DONE;
+			exitProcedureDone();
 			break;
 		}
-//#endif //MONITOR_EXIT
-
-#ifdef APACHE
-		// No allocation or deallocation, which indicates the apache server is
-		// pretty inactive, so why don't go asleep for a while.
-		if(g_transmitter_still_count && !g_delayedBufferCount){
-			if(++staticCount > SLEEP_CONDITION)
-				msSleep(1);
-		}
-		else
-			staticCount = 0;
-#endif //APACHE
 
-		// The per-round sleep is different from the conditional sleep above.
-		//if(sleepEnable)
-		//	nanosleep(&sleepTime, NULL);
-		if(roundMsSleep != -1)
+		int roundMsSleep = g_roundMsSleep;
+		if(roundMsSleep != -1 && !t_pacer.enabled()){
+			idleBegin();
 			msSleep(roundMsSleep);
+			idleEnd();
+		}
+		else if(t_scheduler.enabled())
+			t_scheduler.afterRound(still, fusedPoll);
 	}
+}
 
+// CRUISER_NUMA: reads the topology and sizes the transmitters per node.
+static void numaSetup(void){
+	unsigned nodes = numaInit();
+	if(nodes < 2)
+		return;
+	if(nodes * g_txPerNode > MAX_TRANSMITTERS)
+		g_txPerNode = MAX_TRANSMITTERS / nodes;
+	g_transmitterCount = nodes * g_txPerNode;
+#ifdef DELAYED
+	g_assist_us = 0; // Assist works on the container of node 0 only.
+#endif
+	// Set last, as the user threads begin to sample their nodes then.
+	__sync_synchronize();
+	g_numaNodes = nodes;
+}
 
-#else //DELAYED
-
+// Sets up what the cruiser threads and the final check need: the controls,
+// the containers and, for eager-cruiser, the SIGSEGV handler.
+static void setupCruiser(void){
+	if(g_nodeContainer)
+		return;
+	threadControlInit();
+	readMonitorControls();
+	if(!g_fused && getEnvInt("CRUISER_NUMA", 0))
+		numaSetup();
+	for(unsigned n = 0; n < g_numaNodes; n++){
+		unsigned first = n * g_txPerNode;
+		if(g_txPerNode == 1){
+			g_nodeContainers[n] = g_shards[first] = new List;
+		}else{
+			ContainerGroup *group = new ContainerGroup;
+			for(unsigned i = first; i < first + g_txPerNode; i++){
+				g_shards[i] = new List;
+				group->add(g_shards[i]);
+			}
+			g_nodeContainers[n] = group;
+		}
+	}
+	g_nodeContainer = g_nodeContainers[0];
+	heapProfSetup();
 
+#ifndef DELAYED
 	// The SIGSEGV handler works under the assumption that user code does NOT
 	// install a new SIGSEGV handler.
 	struct sigaction nact;
@@ -293,149 +854,289 @@ void* monitor(void *){ // "void* foo(void)" interface for a thread function.
 		printf("sigaction error\n");
 		exit(-1);
 	}
+#endif //DELAYED
+}
+
+// Creates monitor No.0, which creates the other cruiser threads once the
+// program has started (see waitForStart()). Called at the end of init(), and
+// in a forked child.
+static void createMonitor(void){
+	__sync_add_and_fetch(&g_cruiserThreads, 1);
+	int thread_ret = pthread_create(&g_monitor, NULL, monitor, NULL);
+	if(thread_ret){
+		fprintf(stderr, "Error: monitor thread cannote be created (%d)\n",
+				thread_ret);
+		exit(-1);
+	}
+}
+
+// Called on malloc/free while monitor No.0 waits for the start. Each thread
+// counts its calls locally and adds them up every START_POLL_PERIOD calls;
+// the one crossing CRUISER_START_CALLS wakes the monitor up.
+static void startPoll(void){
+	static __thread unsigned calls;
+	if(++calls < START_POLL_PERIOD)
+		return;
+	unsigned long total = __sync_add_and_fetch(&g_startCalls, calls);
+	if(total >= g_start_calls && total - calls < g_start_calls){
+		pthread_mutex_lock(&g_startMutex);
+		pthread_cond_signal(&g_startCond);
+		pthread_mutex_unlock(&g_startMutex);
+	}
+	calls = 0;
+}
+
+// The lazy start of monitor No.0. Returns false if the cruiser threads are 
+// not to start, e.g. the process is exiting and finalCheck() has taken over.
+// While waiting, the monitor counts as paused.
+static bool waitForStart(void){
+	struct timespec deadline;
+	deadlineAfter(deadline, g_start_us);
+	idleBegin();
+	pthread_mutex_lock(&g_startMutex);
+	while(!g_started && g_startCalls < g_start_calls){
+		if(pthread_cond_timedwait(&g_startCond, &g_startMutex, &deadline) ==
+				ETIMEDOUT)
+			break;
+	}
+	if(!g_started){
+		if(g_exit_procedure == RUNNING){
+			setupCruiser();
+			g_started = 2;
+		}else{
+			g_started = 1;
+		}
+	}
+	bool start = (g_started == 2);
+	pthread_mutex_unlock(&g_startMutex);
+	idleEnd();
+	return start;
+}
+
+// Monitor No. @arg checks the container of NUMA node No. @arg. Monitor No.0,
+// created by createMonitor(), creates the transmitters and the other monitors.
+void* monitor(void *arg){ // "void* foo(void)" interface for a thread function.
+	// malloc/free calls issued by the monitor thread should not be hooked??
+	t_protect = 0;
+	unsigned		node = (unsigned)(unsigned long)arg;
+#ifndef DELAYED
+	t_isMonitor = true;
+#endif
+	t_histograms = &g_nodeHistograms[node];
+#ifdef CRUISER_DEBUG
+	fprintf( stderr, "Monitor No.%u thread id: %lu\n", node,
+		(unsigned long)(pthread_self()));
+#endif
+	if(node == 0 && !waitForStart()){
+		cruiserThreadExit();
+		return NULL;
+	}
+	NodeContainer	*container = g_nodeContainers[node];
+	char			name[16];
+	if(g_heapCounting)
+		t_heapProfile = &g_heapProfiles[node];
+	if(g_numaNodes > 1)
+		snprintf(name, sizeof(name), "cruiser-mon%u", node);
+	else
+		snprintf(name, sizeof(name), "cruiser-mon");
+	setupCruiserThread(name, node);
+
+	applyMonitorControls(node);
+
+	if(node == 0){
+		g_transmitterExitCount = g_monitorExitCount = 0;
+		g_nodeMonitor[0] = pthread_self();
+		for(unsigned i = 0; !g_fused && i < g_transmitterCount; i++){
+			__sync_add_and_fetch(&g_cruiserThreads, 1);
+			if(int thread_ret = pthread_create(&g_transmitter[i], NULL, 
+					transmitter, (void*)(unsigned long)i)){
+				fprintf(stderr, "Error: transmitter thread cannote be created, \
+								return value is %d\n", thread_ret);
+				exit(-1);
+			}
+		}
+		for(unsigned n = 1; n < g_numaNodes; n++){
+			__sync_add_and_fetch(&g_cruiserThreads, 1);
+			if(int thread_ret = pthread_create(&g_nodeMonitor[n], NULL, 
+					monitor, (void*)(unsigned long)n)){
+				fprintf(stderr, "Error: monitor thread cannote be created, \
+								return value is %d\n", thread_ret);
+				exit(-1);
+			}
+		}
+		controlStart();
+		logEvent(EVENT_START, g_transmitterCount, g_numaNodes, 
+			getUsTime() - g_init_begin_time);
+#ifdef EXP
+		if(!g_eventLogKB){
+			FILE *fp = openTextLog();
+			fprintf(fp, "Monitor thread:%s (pid %lu, tid %lu), init duration \
+%u\n", program_invocation_name, (unsigned long)getpid(), 
+				(unsigned long)pthread_self(), getUsTime() - g_init_begin_time);
+			closeTextLog(fp);
+		}
+#endif //EXP
+	}
 
+	if(node == 0){
+#ifdef DELAYED
+#ifdef EXP
+	g_roundCount = g_totalCheckCount = 0;
+	g_maxRoundBufferCount = g_avgRoundBufferCount = 0;
+	g_avgLiveBufferCount = g_avgLiveBufferSize = 0;
+	g_maxLiveBufferCount = g_maxLiveBufferSize = 0;
+	g_avgDelayedBufferCount = g_avgDelayedBufferSize = 0;
+	g_maxDelayedBufferCount = g_maxDelayedBufferSize = 0;
+#endif //EXP
+
+#else //DELAYED
 #ifdef EXP
 	g_roundCount = g_totalCheckCount = 0;
 	g_maxRoundBufferCount = g_avgRoundBufferCount = 0;
 	g_avgLiveBufferCount = g_maxLiveBufferCount = 0;
 	g_avgSignalBufferCount = g_maxSignalBufferCount = 0;
 #endif //EXP
+#endif //DELAYED
+	}
 
-#ifdef SINGLE_EXP
-	g_malloc_count = g_free_count = g_calloc_count = g_realloc_count = 0;
-#endif
+	if(g_fused){
+		fusedMonitor();
+		cruiserThreadExit();
+		return NULL;
+	}
 
-	unsigned long lastLiveCount = 0;
-	while( (g_liveBufferCount = 0, g_nodeContainer->traverse(processNode)) ){
-#ifdef EXP
-		if(g_roundBufferCount){
-			// The size statistics below is commented out, because the size
-			// field may have been corrupted, so the information is inaccurate.
-
-			//total
-			g_roundCount++;
-			g_totalCheckCount += g_roundBufferCount;
-			if(g_roundBufferCount > g_maxRoundBufferCount)
-				g_maxRoundBufferCount = g_roundBufferCount;
-			g_avgRoundBufferCount = ((g_roundCount - 1) * g_avgRoundBufferCount
-									+ g_roundBufferCount) / g_roundCount;
-
-			//live
-			g_avgLiveBufferCount = ((g_roundCount - 1) * g_avgLiveBufferCount
-									+ g_liveBufferCount) / g_roundCount;
-			//g_avgLiveBufferSize = ((g_roundCount - 1) * g_avgLiveBufferSize
-			//						+ liveBufferSize) / g_roundCount;
-			if(g_liveBufferCount > g_maxLiveBufferCount)
-				g_maxLiveBufferCount = g_liveBufferCount;
-			//if(liveBufferSize > g_maxLiveBufferSize)
-			//	g_maxLiveBufferSize = liveBufferSize;
-
-			//buffers that trigger SIGSEGV signals
-			g_avgSignalBufferCount = ((g_roundCount - 1) *
-				g_avgSignalBufferCount + g_signalBufferCount) / g_roundCount;
-			//g_avgDelayedBufferSize = ((g_roundCount - 1) *
-			//	g_avgDelayedBufferSize + g_delayedBufferSize) / g_roundCount;
-			if(g_signalBufferCount > g_maxSignalBufferCount)
-				g_maxSignalBufferCount = g_signalBufferCount;
-			//if(g_delayedBufferSize > g_maxDelayedBufferSize)
-			//	g_maxDelayedBufferSize = g_delayedBufferSize;
+	// Recall the return values of NodeContainer::traverse():
+	//	0: to stop monitor (the feature is not enabled to avoid exploit).
+	//	1: finished one round of traverse.
+	//	2: encountered the section boundary (only for sliced traverse).
+	bool		finalRound = false;
+	unsigned	roundBegin;
+	while((beginRound(), roundBegin = getUsTime(), traverseRound(container))){
+		unsigned roundUs = getUsTime() - roundBegin;
+		roundTime(node, roundUs);
+		safePoint();
+		if(g_boostUs){
+			bool lagging = roundUs > g_boostUs;
+#ifdef DELAYED
+			lagging = lagging || g_assist_wanted;
+#endif
+			boostIfLagging(lagging);
 		}
-		g_signalBufferCount = g_roundBufferCount = 0;
-#endif //EXP
+		bool still = endRound();
+		if(t_controlSeq != g_controlSeq)
+			applyMonitorControls(node);
 
-		if(g_exit_procedure == TRANSMITTER_DONE){
-			g_exit_procedure = MONITOR_BEGIN;
-			continue;
-		}else if(g_exit_procedure == MONITOR_BEGIN){
-			g_exit_procedure = MONITOR_DONE;
+//#ifdef MONITOR_EXIT
+		// The purpose is to perform one more round of traverse at exit.
+		// It is critical to ensure checking the last second overflow.
+		// Each monitor makes its own round; the last one to finish reports.
+		if(g_exit_procedure >= TRANSMITTER_DONE){
+			if(!finalRound){
+				__sync_bool_compare_and_swap(&g_exit_procedure, 
+					TRANSMITTER_DONE, MONITOR_BEGIN);
+				finalRound = true;
+				continue;
+			}
+			if(__sync_add_and_fetch(&g_monitorExitCount, 1) == g_numaNodes)
+				exitProcedureDone();
 			break;
 		}
+//#endif //MONITOR_EXIT
 
-#ifdef APACHE
-		if(g_transmitter_still_count && lastLiveCount == g_liveBufferCount){
-			if(++staticCount > SLEEP_CONDITION)
-				msSleep(1);
-		}
-		else
-			staticCount = 0;
-
-#endif //APACHE
-
-		lastLiveCount = g_liveBufferCount;
-
-		if(roundMsSleep != -1)
+		// The per-round sleep is different from the adaptive one below.
+		//if(sleepEnable)
+		//	nanosleep(&sleepTime, NULL);
+		int roundMsSleep = g_roundMsSleep;
+		if(roundMsSleep != -1 && !t_pacer.enabled()){
+			idleBegin();
 			msSleep(roundMsSleep);
+			idleEnd();
+		}
+		// No allocation or deallocation, which indicates the program is 
+		// pretty inactive, so why don't go asleep for a while.
+		else if(t_scheduler.enabled())
+			t_scheduler.afterRound(still, NULL);
 	}
-#endif //DELAYED
 
+	cruiserThreadExit();
 	return NULL;
 }
 
-void* transmitter(void*){
+// Transmitter No. @arg drains the rings of the thread records assigned to it
+// and inserts the nodes into g_shards[@arg].
+void* transmitter(void *arg){
 	t_protect = 0;
+	unsigned			me = (unsigned)(unsigned long)arg;
+	NodeContainer		*shard = g_shards[me];
+	char				name[16];
+	snprintf(name, sizeof(name), "cruiser-tx%u", me);
+	setupCruiserThread(name, me / g_txPerNode);
 #ifdef CRUISER_DEBUG
-	fprintf( stderr, "Transimitter thread id is %lu\n", (unsigned long)(pthread_self()));
+	fprintf( stderr, "Transimitter No.%u thread id is %lu\n", me, 
+		(unsigned long)(pthread_self()));
 #endif
 
-#ifdef EXP
-	g_threadrecordlist->resetCount();//set procuded count and consumed count in each ring as zero
-#endif
-	unsigned long 		count = 0;
-	unsigned long 		old_count;
-	CruiserNode 		node;
-
-	while(g_initialized != 2)
-		sleep(0);
+	bool				finalPass = false;
+	unsigned			lastRebalance = getUsTime();
+	unsigned			stillPasses = 0;
 
 	while(true){
+		safePoint();
 		//if(__builtin_expect(g_stop, 0)){
 		//	return NULL;
 		//}
-		old_count = count;
-		ThreadRecord *p;
-		for(p = g_threadrecordlist->head; p != NULL; p = p->next){
-			if( !p->threadID )
-				continue;
-			if(!p->consume(node)){
-				if( pthread_kill( p->threadID, 0 ) == ESRCH ){
-						//ESRCH: No thread could be found corresponding to that specified by the given thread ID.
-						p->threadID = 0;
-				}
-			}else{
-				do{
-					ASSERT(node.userAddr);
-					count++;
-					if(node.userAddr)//Actually no need to judge, just in case.
-						g_nodeContainer->insert(node);
-				}while(p->consume(node));
-			}
+		unsigned long count = transmitPass(me, shard);
+		if(g_boostUs)
+			boostIfLagging(count >= (t_boosted ? BOOST_BACKLOG / 4 : 
+				BOOST_BACKLOG));
+
+		if(me == 0 && g_transmitterCount > 1 && 
+				getUsTime() - lastRebalance >= REBALANCE_INTERVAL_US){
+			g_threadrecordlist->rebalance(g_numaNodes, g_txPerNode);
+			lastRebalance = getUsTime();
 		}
 
 //#ifdef MONITOR_EXIT
+		// Each transmitter makes one more pass after the exit is hooked; the
+		// last one to finish hands over to the monitor.
 		if(g_exit_procedure == EXIT_HOOKED){
-			g_exit_procedure = TRANSMITTER_BEGIN;
+			__sync_bool_compare_and_swap(&g_exit_procedure, EXIT_HOOKED, 
+				TRANSMITTER_BEGIN);
+			finalPass = true;
 			continue;
 		}else if(g_exit_procedure == TRANSMITTER_BEGIN){
-			g_exit_procedure = TRANSMITTER_DONE;
+			if(!finalPass){
+				finalPass = true;
+				continue;
+			}
+			if(__sync_add_and_fetch(&g_transmitterExitCount, 1) == 
+					g_transmitterCount)
+				g_exit_procedure = TRANSMITTER_DONE;
 			break;
 		}
 //#endif //MONITOR_EXIT
 
-#ifdef APACHE
-		if(old_count == count){
-			if(++g_transmitter_still_count > SLEEP_CONDITION);
-				msSleep(1);
+		// Nothing to drain for a while, which indicates the program is pretty
+		// inactive (e.g. the backup apache process), so go asleep briefly.
+		if(count)
+			stillPasses = 0;
+		else if(g_parkIdle && ++stillPasses > SLEEP_CONDITION){
+			idleBegin();
+			nsSleep(SCHED_PARK_CHUNK_US * 1000ULL);
+			idleEnd();
 		}
-		else
-			g_transmitter_still_count = 0;
-#endif //APACHE
 	}
 
+	cruiserThreadExit();
 	return NULL;
 }
 
 //to do: print more info. before abort.
-static void attackDetected(void *user_addr, int reason){
+// @site is the allocation site of the buffer, if the node is at hand.
+static void attackDetected(void *user_addr, int reason, unsigned site = 0){
+	PROBE2(attack, user_addr, reason);
+	logEvent(EVENT_ATTACK, (unsigned long)user_addr, reason, site);
+	drainEvents(true);
 	switch(reason){
 		case 0:
 			fprintf(stderr, "\nError: When monitor thread checks user chunk,\n");
@@ -451,6 +1152,13 @@ static void attackDetected(void *user_addr, int reason){
 			break;
 	}
 	fprintf(stderr, "buffer overflow is detected at user address %p\n", user_addr);
+	if(site)
+		printSite(stderr, "The buffer was allocated at:", site);
+	else if(g_siteDepth && reason != 0 && t_threadRecord){
+		printSite(stderr, 
+			"The allocation site is unknown; the call was made at:",
+			captureSite(t_threadRecord));
+	}
 	switch(g_pro_attack){
 		case TO_ABORT:
 			fprintf(stderr, "The process is going to abort due to an attack...\n");
@@ -467,10 +1175,44 @@ static void attackDetected(void *user_addr, int reason){
 	}
 }
 
+// Records the time from the allocation of the buffer in @node to its first
+// check by a monitor, if the node is stamped. The nodes checked by the 
+// assisting threads are left for the monitor.
+inline static void trackLatency(const CruiserNode & node){
+#ifdef NODE_TAGS
+	unsigned stamp = node.stamp;
+	if(__builtin_expect(!stamp || (stamp & STAMP_BIRTH), 1) || !t_histograms)
+		return;
+	int us = (int)((getUsTime() - stamp) & ~STAMP_BIRTH);
+	t_histograms->latencyUs.record(us > 0 ? us : 0);
+	node.stamp = 0;
+#endif
+}
+
+// The CRUISER_NOP busy loop before each check, which slows a monitor down on
+// purpose. The user threads that assist (assist) or run the final pass are
+// not slowed down, as the loop only throttles the cruiser threads.
+inline static void nopDelay(void){
+	if(!t_isCruiser)
+		return;
+	if(g_nopCount == -1){
+#ifdef CRUISER_DEBUG
+		fprintf(stderr, "Read NOPCount in processNode\n");
+#endif
+		char * strNOPCount = getenv("CRUISER_NOP");
+   	 	if (strNOPCount)
+			g_nopCount = atoi(strNOPCount);
+		else
+			g_nopCount = 0;
+	}
+	for(volatile int i = 0; i < g_nopCount; i++)
+		;
+}
 
 #ifdef DELAYED
 // For lazy-cruiser.
-// Checks the buffer whose address is contained in @node.
+// Checks the buffer whose address is contained in @node and releases it if it
+// has been freed by the user.
 // This function is called in list::traverse() using a function pointer, as
 // the amino hashtable's traverse accecpts a function pointer as the parameter.
 // Returns:
@@ -479,6 +1221,7 @@ static void attackDetected(void *user_addr, int reason){
 //	2: have encountered a dummy node (should never happen)
 //	3: have checked a node whose buffer has been freed.
 int processNode(const CruiserNode & node){
+	safePoint();
 	// // g_stop and pro-stop may be exploited, so it is not adopted.
 	// if(__builtin_expect(g_stop, 0)){
 	//	 return 0;
@@ -487,21 +1230,24 @@ int processNode(const CruiserNode & node){
 	// // it is not adopted
 	//	if(g_sleepEnabled)
 	//		nanosleep(&g_sleepTime, NULL);
-	static int NOPCount = -1;
-	if(NOPCount == -1){
-#ifdef CRUISER_DEBUG
-		fprintf(stderr, "Read NOPCount in processNode\n");
-#endif
-		char * strNOPCount = getenv("CRUISER_NOP");
-   	 	if (strNOPCount)
-			NOPCount = atoi(strNOPCount);
-		else
-			NOPCount = 0;
+	nopDelay();
+
+	trackLatency(node);
+	size_t word_size;
+	int ret = verifyNode(node, &word_size);
+	if(ret == 3){
+		t_delayedBufferSize +=  word_size;
+		t_delayedBufferCount++;
+		PROBE2(delayed_free, node.userAddr, word_size);
+		original_free((unsigned long*)node.userAddr - 2);
 	}
+	return ret;
+}
 
-	for(volatile int i = 0; i < NOPCount; i++)
-		;
-
+// Checks the canaries of the buffer in @node without releasing it. Returns
+// as processNode() does; for 3, the size of the buffer in words is stored in
+// @wordSize.
+int verifyNode(const CruiserNode & node, size_t *wordSize){
 	void *addr = node.userAddr;
 	if(__builtin_expect(!addr, 0)) // Dummy node
 		return 2;
@@ -528,9 +1274,7 @@ int processNode(const CruiserNode & node){
 	unsigned long expected_canary = (g_canary ^ word_size);//^ (unsigned long)p;
 	unsigned long canary_free = (g_canary_free ^ word_size);//^ (unsigned long)p;
 
-#ifdef EXP
-	g_roundBufferCount++; g_roundBufferSize +=  word_size;
-#endif
+	t_roundBufferCount++; t_roundBufferSize +=  word_size;
 
 #ifdef CRUISER_DEBUG
 	fprintf(stderr, "\nprocessNode 0, user addr is %p, p[1] (word_size) 0x%lx \
@@ -549,16 +1293,16 @@ int processNode(const CruiserNode & node){
 				p[0]= 0x%lx, p[end]=0x%lx, expected_canary=0x%lx\n",
 				addr, word_size, p[1], p[0], p[2 + word_size], expected_canary);
 //#endif
-			attackDetected(addr, 0);
+			attackDetected(addr, 0, nodeSite(node));
 		}
-#ifdef EXP
-		g_delayedBufferSize +=  word_size;
-#endif
-		g_delayedBufferCount++;
-		original_free((void*)p);
+		if(wordSize)
+			*wordSize = word_size;
 		return 3;
 	}
 
+	if(t_heapProfile)
+		t_heapProfile->add(node, word_size);
+
 	// if "canary_left != expected_canary" is false, "word_size" is intact.
 	// so it can be used in "p[2 + word_size]" to read the end canary
 	unsigned long end = -1L;
@@ -572,7 +1316,7 @@ int processNode(const CruiserNode & node){
 			p, word_size, canary_left, p[1], p[0], end, expected_canary,
 			canary_free);
 //#endif
-		attackDetected(addr, 0);
+		attackDetected(addr, 0, nodeSite(node));
 	}
 	return 1;
 }
@@ -581,29 +1325,22 @@ int processNode(const CruiserNode & node){
 
 // For eager-cruiser
 int processNode(const CruiserNode & node){
-	static int NOPCount = -1;
-	if(NOPCount == -1){
-#ifdef CRUISER_DEBUG
-		fprintf(stderr, "Read NOPCount in processNode\n");
-#endif
-		char * strNOPCount = getenv("CRUISER_NOP");
-   	 	if (strNOPCount)
-			NOPCount = atoi(strNOPCount);
-		else
-			NOPCount = 0;
-	}
+	safePoint();
+	nopDelay();
 
-	for(volatile int i = 0; i < NOPCount; i++)
-		;
+	trackLatency(node);
+	return verifyNode(node, NULL);
+}
 
+// Checks the canary of the buffer in @node. A thread calling it must have
+// t_isMonitor set, as the buffer may be released meanwhile.
+int verifyNode(const CruiserNode & node, size_t *){
 	if(__builtin_expect(!node.userAddr, 0)) // Dummy node
 		return 2;
 
-#ifdef EXP
-	g_roundBufferCount++;
-#endif
+	t_roundBufferCount++;
 
-	if(sigsetjmp(g_jmp, 1)){
+	if(sigsetjmp(t_jmp, 1)){
 #ifdef CRUISER_DEBUG
 		fprintf(stderr, "SIGSEGV, user addr %p\n", node.userAddr);
 #endif
@@ -657,15 +1394,178 @@ int processNode(const CruiserNode & node){
 	currentID = p[0];
 	if(ID != currentID)
 		return 3;
-#ifdef EXP
-	g_liveBufferCount++;
-#endif
+	t_liveBufferCount++;
+	t_liveBufferSize += word_size;
+	if(t_heapProfile)
+		t_heapProfile->add(node, word_size);
 
 	if(canary != g_canary)
-		attackDetected((void*)(p+2), 0);
+		attackDetected((void*)(p+2), 0, nodeSite(node));
 
 	return 1;
 }
 #endif //DELAYED
+
+#ifdef MONITOR_EXIT
+// The final check at exit. Rather than waiting for the 
+// transmitters and monitors to make one more pass and round, the exiting 
+// thread pauses them, drains the rings itself, and checks all the buffers
+// with CRUISER_EXIT_WORKERS worker threads (default: the online CPUs, at most
+// EXIT_MAX_WORKERS); a few buffers are checked inline. It waits for the 
+// workers until they report completion or CRUISER_EXIT_DEADLINE_MS 
+// milliseconds (default 1000) have passed since the exit began.
+#define EXIT_CHUNK			4096
+#define EXIT_MAX_WORKERS	8
+static CruiserNode				*g_exitNodes;
+static unsigned long			g_exitNodeCount;
+static unsigned long volatile	g_exitNext; // The next node to be claimed
+static unsigned					g_exitWorkers;
+static unsigned					g_exitWorkersDone; // Under g_exitMutex
+
+static void countNode(const CruiserNode &){
+	g_exitNodeCount++;
+}
+
+static void collectNode(const CruiserNode & node){
+	g_exitNodes[g_exitNext++] = node;
+}
+
+static void* exitWorker(void *){
+	t_protect = 0;
+#ifndef DELAYED
+	t_isMonitor = true;
+#endif
+	unsigned long begin;
+	while((begin = __sync_fetch_and_add(&g_exitNext, EXIT_CHUNK)) < 
+			g_exitNodeCount){
+		unsigned long end = begin + EXIT_CHUNK;
+		if(end > g_exitNodeCount)
+			end = g_exitNodeCount;
+		for(unsigned long i = begin; i < end; i++)
+			verifyNode(g_exitNodes[i], NULL);
+	}
+	pthread_mutex_lock(&g_exitMutex);
+	if(++g_exitWorkersDone == g_exitWorkers)
+		pthread_cond_signal(&g_exitDone);
+	pthread_mutex_unlock(&g_exitMutex);
+	return NULL;
+}
+
+// Called by beforeExit() after g_exit_procedure is set to EXIT_HOOKED. If the
+// cruiser threads cannot be paused within PAUSE_WAIT_US, they are left to
+// finish the exit procedure by themselves, up to the deadline.
+static void finalCheck(void){
+	if(g_initialized != 2 || !g_threadrecordlist)
+		return;
+	int protect = t_protect;
+	t_protect = 0;
+	// If the cruiser threads have not been created, the exiting thread checks
+	// the buffers that are still in the rings.
+	pthread_mutex_lock(&g_startMutex);
+	if(!g_started){
+		g_started = 1;
+		setupCruiser();
+		pthread_cond_signal(&g_startCond);
+	}
+	pthread_mutex_unlock(&g_startMutex);
+	t_protect = protect;
+	if(!g_nodeContainer)
+		return;
+	struct timespec deadline;
+	unsigned deadlineUs = getEnvInt("CRUISER_EXIT_DEADLINE_MS", 1000) * 1000U;
+	unsigned exitBegin = getUsTime();
+	deadlineAfter(deadline, deadlineUs);
+
+	__sync_synchronize();
+	bool quiet = true;
+#ifdef DELAYED
+	quiet = waitForAssists(&deadline);
+#endif
+	unsigned elapsed = getUsTime() - exitBegin;
+	unsigned left = elapsed < deadlineUs ? deadlineUs - elapsed : 0;
+	if(!quiet || !pauseCruiserThreads(left < PAUSE_WAIT_US ? left : 
+			PAUSE_WAIT_US)){
+		// A thread still running may release or unlink the nodes, so they
+		// cannot be checked from here. The cruiser threads make their own
+		// last pass and round instead, as in the builds without 
+		// MONITOR_EXIT, and are waited for until the deadline.
+		resumeCruiserThreads();
+		pthread_mutex_lock(&g_exitMutex);
+		while(g_exit_procedure != MONITOR_DONE){
+			if(pthread_cond_timedwait(&g_exitDone, &g_exitMutex, &deadline) ==
+					ETIMEDOUT)
+				break;
+		}
+		pthread_mutex_unlock(&g_exitMutex);
+		return;
+	}
+
+	protect = t_protect;
+	t_protect = 0;
+	for(unsigned i = 0; i < g_transmitterCount; i++){
+		while(transmitPass(i, g_shards[i], true))
+			;
+	}
+
+	g_exitNodeCount = 0;
+	for(unsigned n = 0; n < g_numaNodes; n++)
+		g_nodeContainers[n]->visit(countNode);
+	size_t mapSize = g_exitNodeCount * sizeof(CruiserNode);
+	void *map = MAP_FAILED;
+	if(g_exitNodeCount)
+		map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map != MAP_FAILED){
+		g_exitNodes = (CruiserNode*)map;
+		g_exitNext = 0;
+		for(unsigned n = 0; n < g_numaNodes; n++)
+			g_nodeContainers[n]->visit(collectNode);
+		g_exitNext = 0;
+
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		int workers = getEnvInt("CRUISER_EXIT_WORKERS", 
+			cpus < EXIT_MAX_WORKERS ? (int)cpus : EXIT_MAX_WORKERS);
+		if(workers < 1)
+			workers = 1;
+		if((unsigned long)workers > g_exitNodeCount / EXIT_CHUNK)
+			workers = g_exitNodeCount / EXIT_CHUNK;
+		g_exitWorkers = g_exitWorkersDone = 0;
+		for(int i = 0; i < workers; i++){
+			pthread_t worker;
+			if(pthread_create(&worker, NULL, exitWorker, NULL))
+				break;
+			pthread_detach(worker);
+			g_exitWorkers++;
+		}
+
+		if(g_exitWorkers){
+			pthread_mutex_lock(&g_exitMutex);
+			while(g_exitWorkersDone < g_exitWorkers){
+				if(pthread_cond_timedwait(&g_exitDone, &g_exitMutex, 
+						&deadline) == ETIMEDOUT)
+					break;
+			}
+			pthread_mutex_unlock(&g_exitMutex);
+		}else{
+			// Too few buffers to be worth a thread.
+#ifndef DELAYED
+			bool isMonitor = t_isMonitor;
+			t_isMonitor = true;
+#endif
+			for(unsigned long i = 0; i < g_exitNodeCount; i++)
+				verifyNode(g_exitNodes[i], NULL);
+#ifndef DELAYED
+			t_isMonitor = isMonitor;
+#endif
+		}
+		// A worker still running past the deadline keeps using the nodes.
+		if(g_exitWorkersDone == g_exitWorkers)
+			munmap(map, mapSize);
+	}
+	t_protect = protect;
+	// The paused cruiser threads sleep until the process is gone.
+	exitProcedureDone();
+}
+#endif //MONITOR_EXIT
 }//namespace cruiser
 #endif //MONITOR_H
@@ -0,0 +1,92 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data 
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu. 
+ ***************************************************************************/
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <sched.h> // sched_getcpu, cpu_set_t
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+
+namespace cruiser{
+
+#define NUMA_MAX_CPUS		1024
+#define NUMA_SAMPLE_PERIOD	256 // A thread checks its node every this many mallocs
+
+// The CPUs of each monitored node, and the node of each CPU. Node numbers are
+// dense: the nodes are numbered in the order found under /sys, and nodes
+// without CPUs are skipped.
+static cpu_set_t			g_nodeCpus[MAX_NUMA_NODES];
+static unsigned char		g_cpuNode[NUMA_MAX_CPUS];
+
+// Parses a sysfs cpulist such as "0-3,8-11" into @set.
+static void parseCpuList(const char *str, cpu_set_t *set){
+	CPU_ZERO(set);
+	while(*str && *str != '\n'){
+		char *end;
+		unsigned long first = strtoul(str, &end, 10), last = first;
+		if(end == str)
+			break;
+		if(*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		for(unsigned long cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; 
+				cpu++)
+			CPU_SET(cpu, set);
+		str = (*end == ',') ? end + 1 : end;
+	}
+}
+
+// Reads the NUMA topology from /sys. Returns the number of nodes with CPUs,
+// at most MAX_NUMA_NODES; 1 if the topology cannot be read.
+// It calls fopen, so the caller must have t_protect == 0.
+static unsigned numaInit(void){
+	unsigned nodes = 0;
+	char path[64], line[4096];
+	for(unsigned n = 0; n < 256 && nodes < MAX_NUMA_NODES; n++){
+		snprintf(path, sizeof(path), 
+			"/sys/devices/system/node/node%u/cpulist", n);
+		FILE *fp = fopen(path, "r");
+		if(!fp)
+			continue;
+		bool ok = fgets(line, sizeof(line), fp);
+		fclose(fp);
+		if(!ok)
+			continue;
+		parseCpuList(line, &g_nodeCpus[nodes]);
+		if(!CPU_COUNT(&g_nodeCpus[nodes]))
+			continue;
+		for(unsigned cpu = 0; cpu < NUMA_MAX_CPUS; cpu++)
+			if(CPU_ISSET(cpu, &g_nodeCpus[nodes]))
+				g_cpuNode[cpu] = nodes;
+		nodes++;
+	}
+	return nodes ? nodes : 1;
+}
+
+// The node the calling thread is running on.
+inline static unsigned currentNode(void){
+	int cpu = sched_getcpu();
+	return (cpu >= 0 && cpu < NUMA_MAX_CPUS) ? g_cpuNode[cpu] : 0;
+}
+
+}//namespace cruiser
+
+#endif //NUMA_H
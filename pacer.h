@@ -0,0 +1,175 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data 
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu. 
+ ***************************************************************************/
+
+#ifndef PACER_H
+#define PACER_H
+
+#include "common.h"
+#include "thread_control.h"
+
+namespace cruiser{
+
+#define PACER_SLICE_NS		1000000ULL // Target CPU time of one slice
+#define PACER_MIN_BUDGET	16u
+#define PACER_MAX_BUDGET	(1u<<20)
+
+// Keeps the monitor thread within a CPU budget, e.g. 15% of one core
+// (CRUISER_CPU_SHARE=15). The monitor traverses in slices; after each slice
+// the pacer measures the CPU time the thread has spent on it 
+// (CLOCK_THREAD_CPUTIME_ID), sleeps long enough for the slice to fit the 
+// share, and scales the number of buffers per slice so that a slice takes
+// about PACER_SLICE_NS of CPU time.
+// If a round takes longer than CRUISER_MAX_ROUND_MS, the pacer stops 
+// sleeping until the round is finished, so the detection latency stays
+// bounded at the cost of exceeding the budget.
+// 
+// We use "struct" to avoid invoking the constructor, as the monitor thread
+// may be running before the static constructors of this library.
+struct Pacer{
+	unsigned			share; // In percent of one core; 0 means disabled.
+	unsigned long long	maxRoundNs; // 0 means unlimited
+	unsigned			budget; // Buffers to check per slice
+	unsigned long long	sliceCpu, sliceWall; // When the slice began
+	unsigned long long	roundBegin;
+
+	void configure(int percent, int maxRoundMs){
+		share = (percent > 0 && percent < 100) ? percent : 0;
+		maxRoundNs = maxRoundMs > 0 ? maxRoundMs * 1000000ULL : 0;
+		budget = 1024;
+	}
+
+	bool enabled(){return share;}
+
+	unsigned getBudget(){return budget;}
+
+	void beginRound(){
+		roundBegin = getNsTime(CLOCK_MONOTONIC);
+	}
+
+	void beginSlice(){
+		sliceCpu = getNsTime(CLOCK_THREAD_CPUTIME_ID);
+		sliceWall = getNsTime(CLOCK_MONOTONIC);
+	}
+
+	void endSlice(){
+		unsigned long long cpu = getNsTime(CLOCK_THREAD_CPUTIME_ID) - sliceCpu;
+		unsigned long long now = getNsTime(CLOCK_MONOTONIC);
+		unsigned long long wall = now - sliceWall;
+
+		// Move half way towards the budget that would take PACER_SLICE_NS.
+		if(cpu){
+			unsigned long long target = budget * PACER_SLICE_NS / cpu;
+			if(target > PACER_MAX_BUDGET)
+				target = PACER_MAX_BUDGET;
+			budget = (budget + target) / 2;
+			if(budget < PACER_MIN_BUDGET)
+				budget = PACER_MIN_BUDGET;
+		}
+
+		if(maxRoundNs && now - roundBegin >= maxRoundNs)
+			return;
+		// cpu / (wall + sleep) = share / 100
+		unsigned long long period = cpu * 100 / share;
+		if(period > wall){
+			idleBegin();
+			nsSleep(period - wall);
+			idleEnd();
+		}
+	}
+};
+
+static __thread Pacer	t_pacer; // Per monitor
+
+#define SCHED_MAX_LATENCY_MS	10 // Default ceiling of the inter-round delay
+#define SCHED_MIN_DELAY_US		50
+#define SCHED_PARK_CHUNK_US		1000
+
+// Picks the delay between two rounds. A round is busy if the transmitters 
+// have drained any node since the previous round or the round has released
+// (lazy) or lost (eager) any buffer; a busy round is followed by the next one
+// right away. Each idle round doubles the delay from SCHED_MIN_DELAY_US up to
+// the ceiling, CRUISER_MAX_LATENCY_MS. The monitor parks in chunks of
+// SCHED_PARK_CHUNK_US and wakes up early once new nodes are drained, a scan is
+// asked for (g_scanWanted) or the process begins to exit.
+struct RoundScheduler{
+	unsigned		maxDelayUs; // 0 means disabled
+	unsigned		delayUs;
+	unsigned long	lastTransmitted;
+
+	void configure(int maxLatencyMs){
+		maxDelayUs = maxLatencyMs > 0 ? maxLatencyMs * 1000 : 0;
+		delayUs = 0;
+		lastTransmitted = g_transmittedCount;
+	}
+
+	bool enabled(){return maxDelayUs;}
+
+	// @still: no buffer was released or lost in the round.
+	// @poll: called per chunk of parking; the fused monitor drains the rings.
+	void afterRound(bool still, void (*poll)(void)){
+		unsigned long transmitted = g_transmittedCount;
+		if(!still || transmitted != lastTransmitted || 
+				g_exit_procedure != RUNNING || g_scanWanted){
+			lastTransmitted = transmitted;
+			delayUs = 0;
+			return;
+		}
+		delayUs = delayUs ? delayUs * 2 : SCHED_MIN_DELAY_US;
+		if(delayUs > maxDelayUs)
+			delayUs = maxDelayUs;
+
+		unsigned begin = getUsTime(), elapsed;
+		while((elapsed = getUsTime() - begin) < delayUs){
+			unsigned left = delayUs - elapsed;
+			idleBegin();
+			nsSleep((left < SCHED_PARK_CHUNK_US ? left : SCHED_PARK_CHUNK_US)
+				* 1000ULL);
+			idleEnd();
+			if(poll)
+				poll();
+			if(g_transmittedCount != lastTransmitted || 
+					g_exit_procedure != RUNNING || g_scanWanted){
+				delayUs = 0;
+				break;
+			}
+		}
+	}
+};
+
+static __thread RoundScheduler	t_scheduler; // Per monitor
+// Set if the adaptive delay is on; the transmitters then back off as well.
+static bool						g_parkIdle;
+
+// The controls of the monitors, read from the environment by setupCruiser()
+// and changed at runtime through the control socket (control.h), which then
+// bumps g_controlSeq; each monitor applies them again after its round.
+static int volatile				g_roundMsSleep = -1; // CRUISER_SLEEP; -1: none
+static int volatile				g_cpuShare; // CRUISER_CPU_SHARE
+static int volatile				g_maxRoundMs; // CRUISER_MAX_ROUND_MS
+static int volatile				g_maxLatencyMs; // CRUISER_MAX_LATENCY_MS
+// CRUISER_NOP: an empty loop of that many iterations per node checked, to
+// slow the monitor down in experiments; -1 until processNode() reads it.
+static int volatile				g_nopCount = -1;
+static unsigned volatile		g_controlSeq;
+static __thread unsigned		t_controlSeq;
+
+}//namespace cruiser
+
+#endif //PACER_H
@@ -0,0 +1,71 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT (statically defined tracing) probes, for tracing cruiser under real
+// load with perf or bpftrace instead of rebuilding with CRUISER_DEBUG, e.g.
+//	bpftrace -e 'usdt:./liblazycruiser.so:cruiser:round_end
+//		{ @us = hist(arg1); }' -p <pid>
+//	perf buildid-cache --add ./liblazycruiser.so;
+//	perf record -e sdt_cruiser:ring_grow -p <pid>
+//
+// A probe is a single nop in the code and a note in the ELF file; the tracer
+// turns the nop into a breakpoint when it attaches. The arguments are
+// computed either way, so they are only values already at hand.
+//
+// The probes need <sys/sdt.h> (systemtap-sdt-dev, systemtap-sdt-devel);
+// without it, or with -DCRUISER_NO_PROBES, they expand to nothing.
+// In libcruiser.so, where each mode is compiled with -Dcruiser=cruiser_<mode>,
+// the provider is cruiser_<mode>, e.g. cruiser_lazy:round_end.
+//
+// Probe				Arguments
+// malloc				size
+// free					user address
+// realloc				user address, new size
+// ring_grow			thread record, new ring size
+// ring_drop			thread record
+// tx_batch				transmitter, nodes moved by the pass
+// round_begin
+// round_end			NUMA node, microseconds, buffers checked
+// delayed_free			user address, size in words (lazy-cruiser)
+// attack				user address, reason (see attackDetected)
+
+#if !defined(CRUISER_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CRUISER_PROBES
+#endif
+#endif
+
+#ifdef CRUISER_PROBES
+#define PROBE0(name)					DTRACE_PROBE(cruiser, name)
+#define PROBE1(name, a)					DTRACE_PROBE1(cruiser, name, a)
+#define PROBE2(name, a, b)				DTRACE_PROBE2(cruiser, name, a, b)
+#define PROBE3(name, a, b, c)			DTRACE_PROBE3(cruiser, name, a, b, c)
+#else
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+#endif //PROBES_H
@@ -0,0 +1,119 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// -DCRUISER_PROFILE: the cycles cruiser adds to the calls of the user threads,
+// stage by stage. Each stage is bracketed by PROFILE_BEGIN/PROFILE_END, which
+// read the time stamp counter and record the difference in a histogram of the
+// ThreadRecord of the calling thread; the monitor sums them up and appends the
+// percentiles to cruiser.log on SIGUSR1 and at exit (dumpProfile, monitor.h).
+//
+// In the other builds the two macros expand to nothing.
+//
+// rdtsc is not serializing, so a stage of a few cycles may be measured a few
+// cycles off; the cost of reading the counter itself is measured and printed
+// with the figures. The counter ticks at a constant rate, which is not
+// necessarily the core clock; the ns per tick is printed as well.
+
+#ifdef CRUISER_PROFILE
+
+#include <signal.h> // sigaction
+#include <string.h> // memset
+#include "utility.h"
+#include "histogram.h"
+
+namespace cruiser{
+
+enum ProfileStage{
+	PROFILE_ENCAPSULATE,	// afterMalloc: the canaries, the node, the statistics
+	PROFILE_PRODUCE,		// afterMalloc: ThreadRecord::produce, growth included
+	PROFILE_GROW,			// ThreadRecord::produceSlow: chaining a new ring
+	PROFILE_FREE,			// beforeFree
+	// realloc: the new buffer and the copy only, so that no cycle is counted
+	// twice; its afterMalloc() and beforeFree() are recorded above.
+	PROFILE_REALLOC_COPY,
+	PROFILE_STAGES
+};
+
+static const char * const g_profileStageNames[PROFILE_STAGES] = {
+	"encapsulate", "produce", "ring grow", "beforeFree", "realloc copy"};
+
+inline static unsigned long long readTsc(void){
+#if defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	return getNsTime(CLOCK_MONOTONIC);
+#endif
+}
+
+// The histograms of a thread, in cycles; only the owner thread records.
+struct Profile{
+	Histogram		stages[PROFILE_STAGES];
+
+	void add(unsigned stage, unsigned long long cycles){
+		stages[stage].record(cycles < 0xffffffffULL ? (unsigned)cycles :
+			0xffffffffU);
+	}
+};
+
+// Set by SIGUSR1; monitor No.0 dumps the profile after its round.
+static int volatile					g_profileDump;
+// Taken at init, to convert cycles into nanoseconds.
+static unsigned long long			g_profileTsc0, g_profileNs0;
+
+static void profileSignal(int){
+	g_profileDump = 1;
+}
+
+// Replaces the handler of SIGUSR1, if the program has any.
+static void profileInit(void){
+	g_profileTsc0 = readTsc();
+	g_profileNs0 = getNsTime(CLOCK_MONOTONIC);
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = profileSignal;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	if(sigaction(SIGUSR1, &act, NULL) < 0)
+		fprintf(stderr, "Error: sigaction(SIGUSR1) failed\n");
+}
+
+}//namespace cruiser
+
+#define PROFILE_BEGIN(t)				unsigned long long t = readTsc()
+// The counter is read before @record is evaluated, which may be an access to
+// t_threadRecord.
+#define PROFILE_END(record, stage, t)	do{ \
+		unsigned long long _cycles = readTsc() - (t); \
+		ThreadRecord *_record = (record); \
+		if(_record) \
+			_record->profile.add(stage, _cycles); \
+	}while(0)
+
+#else
+
+#define PROFILE_BEGIN(t)
+#define PROFILE_END(record, stage, t)
+
+#endif //CRUISER_PROFILE
+
+#endif //PROFILE_H
@@ -0,0 +1,216 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef SITES_H
+#define SITES_H
+
+#include <dlfcn.h> // dladdr
+#include <link.h> // dl_iterate_phdr
+#include <pthread.h> // pthread_getattr_np
+#include <string.h>
+#include <sys/mman.h> // mmap
+#include "thread_record.h"
+
+namespace cruiser{
+
+// CRUISER_SITES=<frames>: the allocation site of each buffer, so that an
+// overflow report names the calling path that allocated the buffer, not only
+// its address.
+//
+// At malloc, the path is taken by following the frame pointers, which is a
+// few loads per frame where glibc backtrace() would unwind with the DWARF
+// tables. The frames of cruiser itself (built with -fno-omit-frame-pointer)
+// are skipped, so the first frame is the caller of malloc; the ones beyond
+// it are only found if the program keeps its frame pointers, and the walk
+// stops at the first frame that does not look like one: a frame pointer must
+// grow towards the top of the thread's stack and stay below it.
+//
+// The path is interned in g_sites, a lock-free open-addressing hash table
+// keyed by the hash of the path, and the node of the buffer carries the index
+// of its entry as a 32-bit site ID (CruiserNode::site; 0 means unknown).
+// Entries are never removed; once SITE_PROBES slots have been tried, the path
+// is left unknown and counted in g_siteOverflows, which the stats page and
+// the metrics report.
+
+#define MAX_SITE_FRAMES			8
+#define SITE_TABLE_SIZE			(1u << 16) // A power of two
+#define SITE_PROBES				64
+
+struct SiteEntry{
+	unsigned volatile	hash; // 0: the entry is free.
+	unsigned volatile	depth; // 0 until "pcs" is written
+	unsigned long		pcs[MAX_SITE_FRAMES]; // Return addresses
+};
+
+static unsigned					g_siteDepth; // 0: no site is recorded.
+static SiteEntry				*g_sites;
+static unsigned long			g_selfBegin, g_selfEnd; // cruiser's text
+static unsigned long volatile	g_siteOverflows; // Paths left unknown
+
+static int findSelf(struct dl_phdr_info *info, size_t, void *){
+	unsigned long self = (unsigned long)&findSelf;
+	unsigned long begin = ~0UL, end = 0;
+	for(int i = 0; i < info->dlpi_phnum; i++){
+		const ElfW(Phdr) &ph = info->dlpi_phdr[i];
+		if(ph.p_type != PT_LOAD)
+			continue;
+		unsigned long b = info->dlpi_addr + ph.p_vaddr;
+		if(b < begin)
+			begin = b;
+		if(b + ph.p_memsz > end)
+			end = b + ph.p_memsz;
+	}
+	if(self < begin || self >= end)
+		return 0;
+	g_selfBegin = begin;
+	g_selfEnd = end;
+	return 1;
+}
+
+// Reads CRUISER_SITES; invoked by init().
+static void siteInit(void){
+	int depth = getEnvInt("CRUISER_SITES", 0);
+	if(depth <= 0)
+		return;
+#ifndef NODE_TAGS
+	fprintf(stderr, "Error: CRUISER_SITES needs -DNODE_TAGS; ignored\n");
+	return;
+#endif
+	void *p = mmap(NULL, SITE_TABLE_SIZE * sizeof(SiteEntry),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0);
+	if(p == MAP_FAILED || !dl_iterate_phdr(findSelf, NULL)){
+		fprintf(stderr, "Error: CRUISER_SITES is ignored\n");
+		return;
+	}
+	g_sites = (SiteEntry*)p;
+	g_siteDepth = depth < MAX_SITE_FRAMES ? depth : MAX_SITE_FRAMES;
+}
+
+// Returns the ID of the path @pcs[0..@depth), interning it if needed.
+static unsigned internSite(const unsigned long *pcs, unsigned depth){
+	unsigned long long x = depth;
+	for(unsigned i = 0; i < depth; i++)
+		x = (x ^ pcs[i]) * 0x9e3779b97f4a7c15ULL;
+	unsigned h = (unsigned)(x >> 32);
+	if(!h)
+		h = 1;
+	for(unsigned i = 0; i < SITE_PROBES; i++){
+		unsigned slot = (h + i) & (SITE_TABLE_SIZE - 1);
+		SiteEntry &e = g_sites[slot];
+		unsigned key = e.hash;
+		if(!key){
+			if(__sync_bool_compare_and_swap(&e.hash, 0, h)){
+				memcpy(e.pcs, pcs, depth * sizeof(long));
+				__sync_synchronize();
+				e.depth = depth;
+				return slot + 1;
+			}
+			key = e.hash;
+		}
+		// An entry being written by another thread (depth 0) is skipped; at
+		// worst the path gets a second entry.
+		if(key == h && __atomic_load_n(&e.depth, __ATOMIC_ACQUIRE) == depth){
+			unsigned j = 0;
+			while(j < depth && e.pcs[j] == pcs[j])
+				j++;
+			if(j == depth)
+				return slot + 1;
+		}
+	}
+	// Any thread may get here, and the count is exported as a counter.
+	__sync_add_and_fetch(&g_siteOverflows, 1);
+	return 0;
+}
+
+// The top of the stack of the calling thread; it calls malloc for the main
+// thread, so the caller must have t_protect == 0.
+static unsigned long stackTop(void){
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+	if(pthread_getattr_np(pthread_self(), &attr))
+		return 0;
+	int ret = pthread_attr_getstack(&attr, &addr, &size);
+	pthread_attr_destroy(&attr);
+	return ret ? 0 : (unsigned long)addr + size;
+}
+
+// Returns the ID of the path that called malloc, 0 if it is unknown.
+// @record is the record of the calling thread.
+static unsigned captureSite(ThreadRecord *record){
+	if(__builtin_expect(!record->stackTop, 0)){
+		int protect = t_protect;
+		t_protect = 0;
+		record->stackTop = stackTop();
+		t_protect = protect;
+		// Unknown: only the caller of malloc is taken (see below).
+		if(!record->stackTop)
+			record->stackTop = 1;
+	}
+	unsigned long pcs[MAX_SITE_FRAMES];
+	unsigned depth = 0;
+	unsigned long *fp = (unsigned long*)__builtin_frame_address(0);
+	while(depth < g_siteDepth){
+		unsigned long pc = fp[1];
+		bool self = (pc >= g_selfBegin && pc < g_selfEnd);
+		if(!self)
+			pcs[depth++] = pc;
+		// A return address into cruiser means that @next is the frame of a
+		// cruiser function, which keeps its frame pointer; it is followed
+		// without the bound, so that the caller of malloc is found even if
+		// the top of the stack is unknown.
+		unsigned long *next = (unsigned long*)fp[0];
+		if(next <= fp || ((unsigned long)next & (sizeof(long) - 1)) ||
+				(!self && (unsigned long)(next + 2) > record->stackTop))
+			break;
+		fp = next;
+	}
+	return depth ? internSite(pcs, depth) : 0;
+}
+
+// Prints the path of @site to @fp, one frame per line, after the line
+// @title, for the overflow reports and the heap profile (heapprof.h).
+static void printSite(FILE *fp, const char *title, unsigned site){
+	if(!site || site > SITE_TABLE_SIZE)
+		return;
+	const SiteEntry &e = g_sites[site - 1];
+	fprintf(fp, "%s\n", title);
+	for(unsigned i = 0; i < e.depth; i++){
+		Dl_info info;
+		// A return address is past the call; look up the call itself.
+		void *pc = (void*)(e.pcs[i] - 1);
+		if(dladdr(pc, &info) && info.dli_fname){
+			if(info.dli_sname)
+				fprintf(fp, "  #%u %p %s(%s+0x%lx)\n", i, (void*)e.pcs[i],
+					info.dli_fname, info.dli_sname,
+					(unsigned long)pc + 1 - (unsigned long)info.dli_saddr);
+			else
+				fprintf(fp, "  #%u %p %s(+0x%lx)\n", i, (void*)e.pcs[i],
+					info.dli_fname,
+					(unsigned long)pc + 1 - (unsigned long)info.dli_fbase);
+		}else
+			fprintf(fp, "  #%u %p\n", i, (void*)e.pcs[i]);
+	}
+}
+
+}//namespace cruiser
+
+#endif //SITES_H
@@ -0,0 +1,138 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu.
+ ***************************************************************************/
+
+#ifndef STATS_PAGE_H
+#define STATS_PAGE_H
+
+#include <string.h> // memcpy
+
+// The layout of the stats page shared by the monitored process (monitor.h)
+// and the readers (cruiser-top.cpp); it includes nothing else of cruiser.
+//
+// With CRUISER_STATS=1, monitor No.0 maps /dev/shm/cruiser.<pid> and updates
+// the page after each round, at most every STATS_PERIOD_US. A reader maps the
+// file read-only and never interacts with the process; the file has mode
+// 0600, so the reader runs as the same user or as root. The figures are
+// protected by a seqlock: the monitor makes "seq" odd while it writes them,
+// so a reader retries until it copies them with the same even "seq" before
+// and after.
+//
+// A reader checks "magic" and "version"; fields are only appended, and
+// "size" tells how much of them the writer knows about.
+
+namespace cruiser{
+
+// A summary of a histogram (see histogram.h).
+struct StatsPercentiles{
+	unsigned long		count;
+	unsigned long		p50;
+	unsigned long		p99;
+	unsigned long		p999;
+	unsigned long		max;
+};
+
+// A size class or an allocation site whose old buffers keep growing (see 
+// leaks.h).
+struct StatsLeak{
+	unsigned			site; // The site ID; 0 for a size class
+	unsigned			checkpoints; // Grown at each of them
+	unsigned long		low; // The size class, in bytes; 0-0 for a site
+	unsigned long		high;
+	unsigned long		pc; // The innermost frame of the site; 0 for a class
+	unsigned long		oldBuffers;
+	unsigned long		oldBytes;
+	unsigned long		growth; // Old bytes added over the checkpoints
+};
+
+#define STATS_LEAKS				8
+#define STATS_PAGE_MAGIC		0x53524343U // "CCRS"
+#define STATS_PAGE_VERSION		1
+#define STATS_PAGE_PATH			"/dev/shm/cruiser.%d"
+
+struct StatsPage{
+	// Written once before the file is renamed into place.
+	unsigned			magic;
+	unsigned			version;
+	unsigned			size; // sizeof(StatsPage) of the writer
+	int					pid;
+	char				mode[8]; // "lazy" or "eager"
+	unsigned long long	startUs; // Wall-clock time, in microseconds
+	// Written by the monitor under the seqlock.
+	unsigned volatile	seq;
+	unsigned			threads; // Thread records in use
+	unsigned long long	updateUs; // When the figures below were taken
+	unsigned long		rounds; // Rounds finished by the monitor(s)
+	unsigned			lastRoundUs;
+	unsigned			maxRoundUs;
+	// The last round of each monitor, summed up.
+	unsigned long		listLength; // Buffers checked
+	unsigned long		liveBuffers;
+	unsigned long		liveBytes;
+	unsigned long		delayedBuffers; // Released by the monitor (lazy)
+	unsigned long		delayedBytes;
+	// Since the process started.
+	unsigned long		ringBacklog; // Nodes not yet drained from the rings
+	unsigned long		transmitted; // Nodes drained into the lists
+	unsigned long		mallocs;
+	unsigned long		frees;
+	unsigned long		bytes;
+	unsigned long		grows;
+	unsigned long		drops;
+	unsigned long		fallbacks;
+	// The rounds and the buffers of all the monitors so far.
+	StatsPercentiles	roundWallUs;
+	StatsPercentiles	roundCpuUs;
+	StatsPercentiles	roundBuffers; // Buffers checked per round
+	// From the allocation to the first check, of the sampled buffers only
+	// (one in g_latencySample, with -DNODE_TAGS); its max is not the worst
+	// case of all the buffers.
+	StatsPercentiles	sampledLatencyUs;
+	// With CRUISER_LEAKS, the leak suspects at the last checkpoint, most
+	// growth first.
+	unsigned			leakRounds; // The age of an old buffer; 0: no ages
+	unsigned			leakCount;
+	StatsLeak			leaks[STATS_LEAKS];
+	// With CRUISER_SITES, the allocations whose path was left unknown
+	// because the site table had no slot for it (see sites.h).
+	unsigned long		siteOverflows;
+};
+
+// Copies the figures of @page into @copy consistently. Returns false if the
+// page is not a valid one, or if it stays locked, e.g. because the process was
+// killed while the monitor was writing.
+inline static bool readStatsPage(const StatsPage *page, StatsPage &copy){
+	if(page->magic != STATS_PAGE_MAGIC || page->version != STATS_PAGE_VERSION)
+		return false;
+	for(int i = 0; i < 1000000; i++){
+		unsigned seq = page->seq;
+		if(seq & 1)
+			continue;
+		__sync_synchronize();
+		memcpy(&copy, (const void*)page, sizeof(copy));
+		__sync_synchronize();
+		if(page->seq == seq)
+			return true;
+	}
+	return false;
+}
+
+}//namespace cruiser
+
+#endif //STATS_PAGE_H
@@ -0,0 +1,234 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data 
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu. 
+ ***************************************************************************/
+
+#ifndef THREAD_CONTROL_H
+#define THREAD_CONTROL_H
+
+#include <errno.h> // ETIMEDOUT
+#include <pthread.h>
+#include <sched.h> // sched_param, SCHED_IDLE, SCHED_BATCH
+#include <string.h>
+#include <sys/resource.h> // setpriority
+#include <sys/syscall.h> // SYS_gettid
+#include <unistd.h>
+#include "numa.h"
+
+namespace cruiser{
+
+#define BOOST_BACKLOG	65536 // Nodes drained in one pass to boost a transmitter
+#define BOOST_RETRY_US	1000000
+
+// How the cruiser threads are placed and scheduled, so that they can be kept
+// off latency-critical cores:
+//	CRUISER_CPUS: the CPUs the cruiser threads may run on, e.g. "2-3,6".
+//	CRUISER_SCHED: "idle" (SCHED_IDLE) or "batch" (SCHED_BATCH).
+//	CRUISER_NICE: the nice value of the cruiser threads.
+//	CRUISER_BOOST_MS: a monitor whose round took longer than this (or, for
+//		lazy-cruiser, that has asked for assist), or a transmitter that 
+//		drained a backlog of BOOST_BACKLOG nodes in one pass, goes back to
+//		SCHED_OTHER at nice 0 until it has caught up. Leaving SCHED_IDLE or
+//		lowering the nice value needs CAP_SYS_NICE or RLIMIT_NICE; without
+//		them, a warning is printed once and the boost is retried every
+//		BOOST_RETRY_US at most.
+static bool					g_hasCruiserCpus;
+static cpu_set_t			g_cruiserCpus;
+static int					g_schedPolicy = SCHED_OTHER;
+static int					g_niceValue;
+static bool					g_hasNiceValue;
+static unsigned				g_boostUs;
+static __thread bool		t_boosted;
+static __thread unsigned	t_boostFailedUs; // When the boost last failed
+static int volatile			g_priorityWarned;
+
+// Before fork() and for the final check at exit, the cruiser threads are 
+// asked to pause at a safe point, i.e. between two nodes, passes or rounds, so
+// that the rings and lists are consistent while another thread uses them (see
+// forkPrepare() in memory.cpp and finalCheck() in monitor.h). A thread paused 
+// at exit stays so until the process is gone.
+#define PAUSE_WAIT_US		100000U
+static int volatile			g_pausePending;
+// Cruiser threads alive; counted by their creator before pthread_create()
+static unsigned volatile	g_cruiserThreads;
+static unsigned volatile	g_pausedThreads; // Cruiser threads at a safe point
+static __thread bool		t_isCruiser;
+// Broadcast while a pause is pending, whenever a cruiser thread pauses, goes
+// idle or returns, and when the last assisting thread leaves assist() (see
+// monitor.h), so that the waiter is woken up rather than polling.
+static pthread_mutex_t		g_pauseMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		g_pauseCond = PTHREAD_COND_INITIALIZER;
+
+static void notifyPause(void){
+	pthread_mutex_lock(&g_pauseMutex);
+	pthread_cond_broadcast(&g_pauseCond);
+	pthread_mutex_unlock(&g_pauseMutex);
+}
+
+// Whether the calling thread is a cruiser thread asked to pause.
+inline static bool pauseWanted(void){
+	return __builtin_expect(g_pausePending, 0) && t_isCruiser;
+}
+
+inline static void safePoint(void){
+	if(pauseWanted()){
+		__sync_add_and_fetch(&g_pausedThreads, 1);
+		notifyPause();
+		while(g_pausePending){
+			if(g_exit_procedure != RUNNING)
+				nsSleep(1000000ULL);
+			else
+				sched_yield();
+		}
+		__sync_sub_and_fetch(&g_pausedThreads, 1);
+	}
+}
+
+// A cruiser thread going to sleep counts as paused until idleEnd(), so that
+// the pause does not wait for it to wake up.
+inline static void idleBegin(void){
+	__sync_add_and_fetch(&g_pausedThreads, 1);
+	if(g_pausePending)
+		notifyPause();
+}
+
+inline static void idleEnd(void){
+	__sync_sub_and_fetch(&g_pausedThreads, 1);
+	safePoint();
+}
+
+// Asks the cruiser threads to pause and waits for at most @us microseconds.
+// Returns true if all of them are paused.
+static bool pauseCruiserThreads(unsigned us){
+	struct timespec deadline;
+	deadlineAfter(deadline, us);
+	g_pausePending = 1;
+	__sync_synchronize();
+	pthread_mutex_lock(&g_pauseMutex);
+	while(g_pausedThreads < g_cruiserThreads){
+		if(pthread_cond_timedwait(&g_pauseCond, &g_pauseMutex, &deadline) ==
+				ETIMEDOUT)
+			break;
+	}
+	bool paused = (g_pausedThreads >= g_cruiserThreads);
+	pthread_mutex_unlock(&g_pauseMutex);
+	return paused;
+}
+
+static void resumeCruiserThreads(void){
+	g_pausePending = 0;
+}
+
+// Called when a cruiser thread returns.
+static void cruiserThreadExit(void){
+	__sync_sub_and_fetch(&g_cruiserThreads, 1);
+	if(g_pausePending)
+		notifyPause();
+}
+
+// Reads the controls. Called by monitor No.0 before the other cruiser 
+// threads are created.
+static void threadControlInit(void){
+	char *str = getenv("CRUISER_CPUS");
+	if(str){
+		parseCpuList(str, &g_cruiserCpus);
+		g_hasCruiserCpus = CPU_COUNT(&g_cruiserCpus);
+	}
+	str = getenv("CRUISER_SCHED");
+	if(str && !strcmp(str, "idle"))
+		g_schedPolicy = SCHED_IDLE;
+	else if(str && !strcmp(str, "batch"))
+		g_schedPolicy = SCHED_BATCH;
+	str = getenv("CRUISER_NICE");
+	if(str){
+		g_niceValue = atoi(str);
+		g_hasNiceValue = true;
+	}
+	g_boostUs = getEnvInt("CRUISER_BOOST_MS", 0) * 1000;
+}
+
+// Applies @policy and @nice to the calling thread. Returns false if either
+// fails, e.g. an unprivileged thread may not lower its nice value.
+static bool setThreadPriority(int policy, int nice){
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	bool ok = !pthread_setschedparam(pthread_self(), policy, &param);
+	// The nice value of a thread is set through its tid on Linux.
+	return !setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) && ok;
+}
+
+// Prints @what once per process.
+static void warnPriority(const char *what){
+	if(!__sync_lock_test_and_set(&g_priorityWarned, 1))
+		fprintf(stderr, "Warning: %s; it needs CAP_SYS_NICE or RLIMIT_NICE\n",
+			what);
+}
+
+// Sets up the calling cruiser thread: its name (seen in top and perf), CPUs
+// and priority. @node is the NUMA node the thread works for.
+static void setupCruiserThread(const char *name, unsigned node){
+	t_isCruiser = true;
+	pthread_setname_np(pthread_self(), name);
+	if(g_numaNodes > 1 || g_hasCruiserCpus){
+		cpu_set_t cpus;
+		if(g_numaNodes > 1 && g_hasCruiserCpus){
+			CPU_AND(&cpus, &g_nodeCpus[node], &g_cruiserCpus);
+			// None of the allowed CPUs is on the node.
+			if(!CPU_COUNT(&cpus))
+				cpus = g_cruiserCpus;
+		}else if(g_numaNodes > 1){
+			cpus = g_nodeCpus[node];
+		}else{
+			cpus = g_cruiserCpus;
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	if((g_schedPolicy != SCHED_OTHER || g_hasNiceValue) && 
+			!setThreadPriority(g_schedPolicy, g_hasNiceValue ? g_niceValue : 0))
+		warnPriority("CRUISER_SCHED/CRUISER_NICE is not fully applied");
+}
+
+// Boosts the calling thread if @lagging, and drops it back to the configured
+// priority once it is no longer lagging.
+static void boostIfLagging(bool lagging){
+	if(lagging == t_boosted)
+		return;
+	if(g_schedPolicy == SCHED_OTHER && (!g_hasNiceValue || g_niceValue <= 0))
+		return; // Nothing to boost from
+	if(!lagging){
+		// Lowering the priority is always allowed.
+		if(setThreadPriority(g_schedPolicy, g_hasNiceValue ? g_niceValue : 0))
+			t_boosted = false;
+		return;
+	}
+	if(t_boostFailedUs && getUsTime() - t_boostFailedUs < BOOST_RETRY_US)
+		return;
+	if(setThreadPriority(SCHED_OTHER, 0)){
+		t_boosted = true;
+		t_boostFailedUs = 0;
+		return;
+	}
+	// Undo the half that may have been applied, e.g. the policy.
+	setThreadPriority(g_schedPolicy, g_hasNiceValue ? g_niceValue : 0);
+	t_boostFailedUs = getUsTime() | 1;
+	warnPriority("CRUISER_BOOST_MS cannot boost the cruiser threads");
+}
+
+}//namespace cruiser
+
+#endif //THREAD_CONTROL_H
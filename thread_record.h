@@ -21,12 +21,17 @@
 #ifndef THREAD_RECORD_H
 #define THREAD_RECORD_H
 
+#include <atomic>
 #include "common.h"
+#include "numa.h"
+#include "profile.h"
 
 namespace cruiser{
 
 #define RING_SIZE 1024u
-#define MAX_RING_SIZE 1u<<22
+#define MAX_RING_SIZE (1u<<22)
+#define OVERFLOW_RING_SIZE (1u<<16)
+#define RING_BATCH_SIZE 64u
 
 // The ring algorithm is based on the the Hong Kong ring paper.
 // Compared to a traditional ring,
@@ -35,72 +40,204 @@ namespace cruiser{
 // (2) the producer and consumer variables reside in different cachelines,
 // to mitigate the false sharing.
 // But it is not exactly the same as the Hong Kong paper:
-// (1) we don't update the indexes by batch to minimize overflow checking delay,
-// so the producer and consumer may operate on the same cacheline of the ring 
+// (1) by default we don't update the indexes by batch to minimize overflow 
+// checking delay, so the producer and consumer may operate on the same 
+// cacheline of the ring 
 // (2) pi is put together with ci_snpashot. ci_snapshot is updated less 
 // frequently than pi (by the producer), so though pi is read by the consumer 
 // while ci_snapshot is updated by the producer, it 
 // does not increase the forced memory copy of the cacheline. 
-class Ring{
+//
+// With -DRING_BATCH, the producer fills the ring through the private index
+// pi_current and publishes pi only every RING_BATCH_SIZE entries, or when 
+// flush() is called (at free). An idle thread may leave a partial batch 
+// unpublished, so the consumer reads pi_current directly every 
+// g_publish_us microseconds (syncProducer), which bounds the delay before a
+// buffer reaches the monitor.
+//
+// The indexes are std::atomic: the producer publishes pi with release and the
+// consumer reads it with acquire, so the entry is visible before the index;
+// the same holds for ci in the other direction.
+class Ring:public ArenaAllocated{
 public:	
 	//Using padding to avoid false sharing between different processors.
 	char			cache_pad0[L1_CACHE_BYTES];
 	CruiserNode		*array;
 	unsigned	 	ringSize;
-	Ring			*next;
+	std::atomic<Ring*>	next;
 	char			cache_pad1[L1_CACHE_BYTES - 3 * sizeof(int*)];
-	unsigned 		volatile pi; // producer index
+#ifdef RING_BATCH
+	std::atomic<unsigned>	pi_current; // next entry to fill
+	unsigned		ci_snapshot;
+	unsigned		pi_batch; // entries filled since pi was published
+	char			cache_pad2[L1_CACHE_BYTES - 3 * sizeof(int)];
+	std::atomic<unsigned>	pi; // producer index, published per batch
+	char			cache_pad4[L1_CACHE_BYTES - sizeof(int)];
+#else
+	std::atomic<unsigned>	pi; // producer index
 	unsigned		ci_snapshot;
 	char			cache_pad2[L1_CACHE_BYTES -2 * sizeof(int)];
-	unsigned 		volatile ci; //consumer index
+#endif
+	std::atomic<unsigned>	ci; //consumer index
 	unsigned		pi_snapshot;
 	char			cache_pad3[L1_CACHE_BYTES - 2 * sizeof(int)];
 
 	unsigned		toIndex(unsigned i){return i & (ringSize - 1);}
 	
+#ifdef RING_BATCH
+	Ring(unsigned int size):ringSize(size), next(NULL), pi_current(0), 
+							ci_snapshot(0), pi_batch(0), pi(0), ci(0), 
+							pi_snapshot(0){
+#else
 	Ring(unsigned int size):ringSize(size), next(NULL), pi(0), ci_snapshot(0), 
 							ci(0), pi_snapshot(0){
-		array = new CruiserNode[size];
-		assert(array);
+#endif
+		array = (CruiserNode*)g_arena.allocate(size * sizeof(CruiserNode));
 	}
 	
-	~Ring(){delete [] array;}
+	~Ring(){g_arena.deallocate(array, ringSize * sizeof(CruiserNode));}
+
+	// Returns NULL instead of throwing if either allocation fails, since the
+	// producer calls it from inside malloc.
+	static Ring* create(unsigned int size){
+		Ring *p = new Ring(size);
+		if(p && !p->array){
+			delete p;
+			p = NULL;
+		}
+		return p;
+	}
 	
 	unsigned getSize(){return ringSize;}
 	
 	bool	produce(const CruiserNode & node){
+#ifdef RING_BATCH
+		unsigned cur = pi_current.load(std::memory_order_relaxed);
+#else
+		unsigned cur = pi.load(std::memory_order_relaxed);
+#endif
 #ifdef CRUISER_DEBUG
 		fprintf(stderr, "produce: This thread id %lu, user addr %p, ring %p, \
 				ringSize %u, ci %u, pi %u\n", (unsigned long)(pthread_self()), 
-				node.userAddr, this, ringSize, ci, pi);
+				node.userAddr, this, ringSize, ci.load(), cur);
 #endif
 		ASSERT(node.userAddr);
-		if((pi -ci_snapshot) >= ringSize){
-			if((pi -ci) >= ringSize)
+		if((cur - ci_snapshot) >= ringSize){
+			unsigned c = ci.load(std::memory_order_acquire);
+			if((cur - c) >= ringSize)
 				return false;
-			ci_snapshot = ci;
+			ci_snapshot = c;
 		}
-		array[toIndex(pi)] = node; // Element value assignment
+		array[toIndex(cur)] = node; // Element value assignment
 		//Make sure the consumer sees the update of the element vaule before pi
-		//__sync_synchronize(); // note needed in x86?
-		pi++;
+#ifdef RING_BATCH
+		pi_current.store(cur + 1, std::memory_order_release);
+		if(++pi_batch >= RING_BATCH_SIZE)
+			publish();
+#else
+		pi.store(cur + 1, std::memory_order_release);
+#endif
 		return true;
 	}
+
+#ifdef RING_BATCH
+	void	publish(){
+		pi_batch = 0;
+		pi.store(pi_current.load(std::memory_order_relaxed), 
+				std::memory_order_release);
+	}
+
+	// Invoked by the producer to publish a partial batch.
+	void	flush(){
+		if(pi_batch)
+			publish();
+	}
+
+	// Invoked by the consumer to pick up a partial batch that the producer
+	// has not published yet.
+	void	syncProducer(){
+		unsigned cur = pi_current.load(std::memory_order_acquire);
+		if((int)(cur - pi_snapshot) > 0)
+			pi_snapshot = cur;
+	}
+#endif
 	
 	bool	consume(CruiserNode & node){
-		if(ci == pi_snapshot){
-			if( ci == pi)
+		unsigned c = ci.load(std::memory_order_relaxed);
+		if(c == pi_snapshot){
+			unsigned p = pi.load(std::memory_order_acquire);
+			// pi may lag behind pi_snapshot after syncProducer().
+			if((int)(p - c) <= 0)
 				return false;
-			pi_snapshot = pi;
+			pi_snapshot = p;
 		}
 			
-		node = array[toIndex(ci)];
-		//__sync_synchronize();
-		ci++;
+		node = array[toIndex(c)];
+		ci.store(c + 1, std::memory_order_release);
 		return true;
 	}	
 };
 
+// The shared queue used by RING_OVERFLOW when a per-thread ring is full.
+// Multiple user threads produce and the transmitter consumes. It is a bounded
+// array queue where each slot carries a sequence number, so producers only
+// contend on the CAS of pi and never wait for each other.
+class OverflowRing:public ArenaAllocated{
+private:
+	struct Slot{
+		unsigned		volatile seq;
+		CruiserNode		node;
+	};
+	char			cache_pad0[L1_CACHE_BYTES];
+	Slot			slots[OVERFLOW_RING_SIZE];
+	unsigned		volatile pi; // Claimed by producers using CAS
+	char			cache_pad1[L1_CACHE_BYTES - sizeof(int)];
+	unsigned		ci; // Only accessed by the consumer
+	char			cache_pad2[L1_CACHE_BYTES - sizeof(int)];
+
+	unsigned		toIndex(unsigned i){return i & (OVERFLOW_RING_SIZE - 1);}
+
+public:
+	OverflowRing():pi(0), ci(0){
+		for(unsigned i = 0; i < OVERFLOW_RING_SIZE; i++)
+			slots[i].seq = i;
+	}
+
+	bool	produce(const CruiserNode & node){
+		unsigned pos;
+		Slot *slot;
+		while(true){
+			pos = pi;
+			slot = &slots[toIndex(pos)];
+			int diff = (int)(slot->seq - pos);
+			if(diff == 0){
+				if(__sync_bool_compare_and_swap(&pi, pos, pos + 1))
+					break;
+			}else if(diff < 0) // The consumer has not released the slot: full
+				return false;
+			// Otherwise, another producer has claimed pos; retry.
+		}
+		slot->node = node;
+		__sync_synchronize();
+		slot->seq = pos + 1; // Publish to the consumer
+		return true;
+	}
+
+	bool	consume(CruiserNode & node){
+		Slot *slot = &slots[toIndex(ci)];
+		if(slot->seq != ci + 1)
+			return false;
+		__sync_synchronize();
+		node = slot->node;
+		__sync_synchronize();
+		slot->seq = ci + OVERFLOW_RING_SIZE; // Hand the slot back
+		ci++;
+		return true;
+	}
+};
+
+static OverflowRing	*g_overflowRing = NULL;
+
 /* A traditional ring implementation.
 class Ring{
 private:	
@@ -150,68 +287,196 @@ public:
 };
 */
 
-class ThreadRecord{
+// The statistics of a thread, kept in all builds. Only the owner thread
+// updates them, with plain increments, and they fill a cacheline of their own
+// in the ThreadRecord, so they cost the malloc path next to nothing. The 
+// monitor sums them up once per round (ThreadRecordList::sumStats) without
+// synchronization, so the sum may lag behind by a few calls.
+struct ThreadStats{
+	// Buffers encapsulated (afterMalloc), by calloc and realloc included
+	unsigned long	mallocs;
+	unsigned long	callocs;
+	// Reallocs that encapsulated a buffer, i.e. all of them but those
+	// resized in place by lazy-cruiser; so "mallocs" includes them.
+	unsigned long	reallocs;
+	unsigned long	frees;
+	unsigned long	bytes; // Bytes allocated, rounded up to words
+	unsigned long	grows; // Rings chained because the ring was full
+	unsigned long	drops; // Nodes dropped; their buffers are unmonitored
+	unsigned long	delayed; // Frees left to the monitor (lazy-cruiser)
+
+	void add(const ThreadStats &s){
+		mallocs += s.mallocs;
+		callocs += s.callocs;
+		reallocs += s.reallocs;
+		frees += s.frees;
+		bytes += s.bytes;
+		grows += s.grows;
+		drops += s.drops;
+		delayed += s.delayed;
+	}
+};
+
+// The sum of the statistics of all the threads, refreshed by monitor No.0 
+// after each round. Other threads (the control socket) copy it under
+// g_threadStatsLock, which monitor No.0 holds while it stores a new sum, so
+// that the figures of a copy come from the same round.
+static ThreadStats		g_threadStats;
+static int volatile		g_threadStatsLock;
+// The threads that free without ever having allocated have no record.
+static ThreadStats		g_strayStats;
+
+class ThreadRecord:public ArenaAllocated{
 public:
-	// The updates of pr and cr are rare, so false sharing is acceptable
+	// The owner reads pr on every malloc while the transmitters write the
+	// fields below it on every pass; pr itself is rarely updated, so that
+	// false sharing is acceptable. What the owner writes or reads on every
+	// malloc is kept in the line of "stats" instead.
 	Ring			*pr; // The ring currently accessed by the producer
+	// Always counted, as it is only touched when the ring is full.
+	unsigned		pFallback; // Nodes sent to the overflow ring or bypassed
+	// The NUMA node the owner thread last ran on; the record is moved to the
+	// transmitters of this node by rebalance().
+	unsigned		volatile node;
 #ifdef EXP // for accounting
 	unsigned		pCount; // The number of produced nodes.
-	unsigned		pDropped; // The number of dropped nodes.
 	char			cache_pad0[L1_CACHE_BYTES - 3 * sizeof(int)];
 	unsigned		cCount; // The number of consumed nodes.
 #endif
 	Ring			*cr; // The ring currently accessed by the consumer
+	// With multiple transmitters, the record is drained by transmitter No.
+	// "shard"; "consuming" is held while draining, so that a record moved to
+	// another transmitter by rebalance() is never drained by two at once.
+	int				volatile consuming;
+	unsigned		volatile shard;
+	unsigned long	volatile transmitted; // Nodes drained by the transmitters
+	unsigned long	lastTransmitted; // "transmitted" at the last rebalance()
 
 	ThreadRecord	* volatile next; // To form a list of threadRecords
 	pthread_t	volatile threadID; // threadID = 0 means it is available.
+	// Set when the owner thread exits. The transmitter releases the record
+	// (threadID = 0) once the ring is drained.
+	int			volatile exited;
+	char			cache_pad1[L1_CACHE_BYTES];
+	// Written only by the owner thread, away from the transmitters
+	ThreadStats		stats;
+	unsigned		numaTick; // Mallocs since "node" was sampled
+#ifdef NODE_TAGS
+	unsigned		stampTick; // Mallocs since a node was stamped
+#endif
+	unsigned long	stackTop; // Of the owner thread, for sites.h; 0: unknown
+	char			cache_pad2[L1_CACHE_BYTES];
+#ifdef CRUISER_PROFILE
+	Profile			profile;
+#endif
+
 	ThreadRecord(unsigned int initialSize = RING_SIZE){
+		pFallback = 0;
+		memset(&stats, 0, sizeof(stats));
+#ifdef CRUISER_PROFILE
+		memset(&profile, 0, sizeof(profile));
+#endif
+		numaTick = node = 0;
+#ifdef NODE_TAGS
+		stampTick = 0;
+#endif
+		stackTop = 0;
+		exited = 0;
+		consuming = 0;
+		shard = 0;
+		transmitted = lastTransmitted = 0;
 #ifdef EXP
-		pCount = pDropped = cCount = 0;
+		pCount = cCount = 0;
 #endif
 		threadID = pthread_self();
-		Ring* p = new Ring(initialSize);
+		Ring* p = Ring::create(initialSize);
 		assert(p);
 		pr = cr = p;
 	}
 
-#ifdef EXP
-	void resetCount(){
-		pCount = pDropped = cCount = 0;	
-	}
-#endif
-
 	// Invoked by the user thread.
+	// Returns false if the node is not delivered to the monitor, in which case
+	// the buffer is left unmonitored.
 	bool	produce(const CruiserNode & node){
 //#endif
 
 #ifdef EXP
 		pCount++;
 #endif
-		if( pr->produce(node) ){
-			return true;
+		if(__builtin_expect(g_numaNodes > 1, 0) && 
+				++numaTick >= NUMA_SAMPLE_PERIOD){
+			numaTick = 0;
+			this->node = currentNode();
 		}
-		unsigned newSize = pr->getSize() * 2;
-		if(newSize > MAX_RING_SIZE)
-			newSize = MAX_RING_SIZE;
-		// We are now in the user thread, so allocate using the original malloc 
-		// in order to avoid infinite recursions.
-		t_protect = 0;
-		Ring	*pNew = new Ring(newSize);
-		t_protect = 1;
-		if(pNew){
-			pNew->produce(node);
-			// The two lines need testing about the writing order.
-			pr->next	= pNew;
-			pr			= pNew;
+		if( pr->produce(node) ){
 			return true;
 		}
-#ifdef EXP
-		pDropped++;
+		return produceSlow(node);
+	}
+
+	// The ring is full; grow it or apply g_ring_full_policy.
+	bool	produceSlow(const CruiserNode & node){
+		if(pr->getSize() < MAX_RING_SIZE || g_ring_full_policy == RING_GROW){
+			PROFILE_BEGIN(growBegin);
+			unsigned newSize = pr->getSize() * 2;
+			if(newSize > MAX_RING_SIZE)
+				newSize = MAX_RING_SIZE;
+			// We are now in the user thread, so allocate using the original 
+			// malloc in order to avoid infinite recursions.
+			t_protect = 0;
+			Ring	*pNew = Ring::create(newSize);
+			t_protect = 1;
+			if(pNew){
+				stats.grows++;
+				PROBE2(ring_grow, this, newSize);
+				pNew->produce(node);
+#ifdef RING_BATCH
+				pr->flush();
 #endif
-		return false;
+				// The consumer leaves the old ring once it sees "next", so
+				// everything in the old ring must be published before.
+				pr->next.store(pNew, std::memory_order_release);
+				pr			= pNew;
+#ifdef CRUISER_PROFILE
+				profile.add(PROFILE_GROW, readTsc() - growBegin);
+#endif
+				return true;
+			}
+		}
 
+		switch(g_ring_full_policy){
+			case RING_SPIN:
+				for(unsigned i = 0; i < g_ring_spin_count; i++){
+					cpuRelax();
+					if(pr->produce(node))
+						return true;
+				}
+				break;
+			case RING_OVERFLOW:
+				if(g_overflowRing && g_overflowRing->produce(node)){
+					pFallback++;
+					return true;
+				}
+				break;
+			case RING_BYPASS:
+				pFallback++;
+				return false;
+			case RING_GROW:
+			default:
+				break;
+		}
+		stats.drops++;
+		PROBE1(ring_drop, this);
+		return false;
 	}
 	
+#ifdef RING_BATCH
+	// Invoked by the user thread, e.g. at free, to publish a partial batch.
+	void	flush(){
+		pr->flush();
+	}
+#endif
+
 	// Invoked by the transmitter thread.
 	bool	consume(CruiserNode & node){
 		if( cr->consume(node) ){
@@ -220,32 +485,104 @@ public:
 #endif
 			return true;
 		}
-		if(cr->next){
+		Ring *pNext = cr->next.load(std::memory_order_acquire);
+		if(pNext){
+			// The producer may have filled the old ring between the failed
+			// consume above and setting "next", so drain it first.
+			if(cr->consume(node)){
+#ifdef EXP
+				cCount++;
+#endif
+				return true;
+			}
 			Ring *pOld = cr;
-			cr = cr->next;
+			cr = pNext;
 			delete pOld;
+			if(!cr->consume(node))
+				return false;
 #ifdef EXP
-			cCount++;//assume the line below is successful.
+			cCount++;
 #endif
-			return cr->consume(node);
+			return true;
 		}
 		return false;
 	}
 };
 
-class ThreadRecordList{
+// Its destructor tells the transmitter that the owner of a record has exited.
+// Previously the transmitter probed the owner using pthread_kill, which is 
+// undefined once the thread has been joined.
+static pthread_key_t			g_threadRecordKey;
+
+static void threadRecordExit(void *record);
+
+class ThreadRecordList:public ArenaAllocated{
 public:
 	ThreadRecord * volatile head;
+	unsigned volatile nextShard; // Round-robin shard for new records
 	
-	ThreadRecordList():head(NULL){}
+	ThreadRecordList():head(NULL), nextShard(0){}
 
-#ifdef EXP
-	void resetCount(){
-		for(ThreadRecord *p = head; p != NULL; p = p->next){
-			p->resetCount();
-		}	
+	// Invoked by transmitter No.0 periodically when there are multiple
+	// transmitters. Each node has @perNode transmitters; a record belongs to
+	// those of its node. If a record is on another node's transmitter, or if 
+	// the node rates observed since the last call are unbalanced among the 
+	// transmitters of a node, the records are reassigned greedily, each to 
+	// the transmitter of its node with the least load so far.
+	void rebalance(unsigned nodes, unsigned perNode){
+		unsigned long load[MAX_TRANSMITTERS] = {0};
+		unsigned long total[MAX_NUMA_NODES] = {0};
+		bool misplaced = false, unbalanced = false;
+		ThreadRecord *p;
+		for(p = head; p != NULL; p = p->next){
+			unsigned long rate = p->transmitted - p->lastTransmitted;
+			load[p->shard] += rate;
+			total[p->shard / perNode] += rate;
+			if(p->threadID && p->shard / perNode != p->node % nodes)
+				misplaced = true;
+		}
+		for(unsigned n = 0; n < nodes; n++){
+			unsigned long maxLoad = 0;
+			for(unsigned i = n * perNode; i < (n + 1) * perNode; i++)
+				if(load[i] > maxLoad)
+					maxLoad = load[i];
+			// Tolerate 25% above the average load.
+			if(maxLoad * perNode > total[n] + total[n] / 4)
+				unbalanced = true;
+		}
+		if(!misplaced && !unbalanced){
+			for(p = head; p != NULL; p = p->next)
+				p->lastTransmitted = p->transmitted;
+			return;
+		}
+
+		for(unsigned i = 0; i < nodes * perNode; i++)
+			load[i] = 0;
+		for(p = head; p != NULL; p = p->next){
+			unsigned long rate = p->transmitted - p->lastTransmitted;
+			p->lastTransmitted = p->transmitted;
+			if(!p->threadID)
+				continue;
+			unsigned first = (p->node % nodes) * perNode, target = first;
+			for(unsigned i = first + 1; i < first + perNode; i++)
+				if(load[i] < load[target])
+					target = i;
+			load[target] += rate;
+			p->shard = target;
+		}
+	}
+
+	// Invoked by monitor No.0 after each round, and at exit. The records
+	// released by exited threads keep their counts, and a thread that reuses
+	// one adds to them, so nothing is lost.
+	void sumStats(ThreadStats &sum){
+		ThreadStats s;
+		memset(&s, 0, sizeof(s));
+		for(ThreadRecord *p = head; p != NULL; p = p->next)
+			s.add(p->stats);
+		s.add(g_strayStats);
+		sum = s;
 	}
-#endif
 	
 	ThreadRecord* getThreadRecord(){
 #ifdef CRUISER_DEBUG
@@ -256,19 +593,29 @@ public:
 		ThreadRecord *p;
 		for(p = head; p != NULL; p = p->next){
 			if(p->threadID == 0 && 
-					__sync_bool_compare_and_swap(&p->threadID, NULL, self))
+					__sync_bool_compare_and_swap(&p->threadID, NULL, self)){
+				p->stackTop = 0;
+				if(g_numaNodes > 1)
+					p->node = currentNode();
+				pthread_setspecific(g_threadRecordKey, p);
 				return p;
+			}
 		}
 		// TODO: use a sandwich structure to protect cruiser data.
 		t_protect = 0;
 		p = new ThreadRecord();
 		t_protect = 1;
 		assert(p);
+		if(g_numaNodes > 1)
+			p->node = currentNode();
+		p->shard = p->node * g_txPerNode + 
+			__sync_fetch_and_add(&nextShard, 1) % g_txPerNode;
 		ThreadRecord *oldHead;
 		do{
 			oldHead = head;
 			p->next = oldHead;
 		}while(!__sync_bool_compare_and_swap(&head, oldHead, p));
+		pthread_setspecific(g_threadRecordKey, p);
 		return p;
 	}
 };
@@ -277,6 +624,13 @@ static ThreadRecordList * g_threadrecordlist;
 
 static __thread ThreadRecord	*t_threadRecord  = NULL;
 
+static void threadRecordExit(void *record){
+	// If the thread allocates in a later destructor, it gets another record.
+	t_threadRecord = NULL;
+	__sync_synchronize(); // All produced nodes are visible before "exited".
+	((ThreadRecord*)record)->exited = 1;
+}
+
 }//namespace cruiser
 
 #endif //THREAD_RECORD_H
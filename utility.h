@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h> // rand, exit, malloc, free
 #include <sys/time.h> // gettimeofday
+#include <time.h> // clock_gettime
 #include <assert.h>
 
 namespace cruiser{
@@ -76,6 +77,34 @@ inline static unsigned int getUsTime(void){
 	return tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+inline static unsigned long long wallUsTime(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+inline static unsigned long long getNsTime(clockid_t clock){
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Used inside busy-waiting loops to be friendly to the sibling hyperthread.
+inline static void cpuRelax(void){
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Returns the integer value of the environment variable @name, or @def if it
+// is not set.
+static int getEnvInt(const char *name, int def){
+	char *str = getenv(name);
+	return str ? atoi(str) : def;
+}
+
 static void msSleep(int msTime){
 	if(msTime == -1)
 		return;
@@ -87,6 +116,24 @@ static void msSleep(int msTime){
 	nanosleep(&sleepTime, NULL);
 }
 
+// Sets @ts to @us microseconds from now, for pthread_cond_timedwait().
+static void deadlineAfter(struct timespec &ts, unsigned us){
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += us / 1000000;
+	ts.tv_nsec += (us % 1000000) * 1000L;
+	if(ts.tv_nsec >= 1000000000L){
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+}
+
+static void nsSleep(unsigned long long nsTime){
+	struct timespec	sleepTime;
+	sleepTime.tv_sec = nsTime / 1000000000ULL;
+	sleepTime.tv_nsec = nsTime % 1000000000ULL;
+	nanosleep(&sleepTime, NULL);
+}
+
 }//namespace cruiser
 
 #endif //UTILITY_H
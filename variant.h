@@ -0,0 +1,44 @@
+/***************************************************************************
+ *  Copyright 2013 Penn State University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Cruiser: concurrent heap buffer overflow monitoring using lock-free data 
+ *  structures, PLDI 2011, Pages 367-377.
+ *  Authors: Qiang Zeng, Dinghao Wu, Peng Liu. 
+ ***************************************************************************/
+
+#ifndef VARIANT_H
+#define VARIANT_H
+
+#include <stddef.h>
+
+// libcruiser.so contains every mode (lazy/eager, X, SX, D, Spec) in one 
+// library. Each mode is memory.cpp compiled with -DCRUISER_VARIANT=\"<name>\"
+// and -Dcruiser=cruiser_<name>, so that its namespace, and thus every symbol,
+// is its own and its hot paths are as specialized as the separate builds.
+// Such a build does not define malloc/free/realloc/calloc nor the constructor;
+// it exports its entry points as cruiser_<name>::g_variant, and dispatch.cpp 
+// selects one at load time according to CRUISER_MODE.
+//
+// The struct is outside the namespace, so all modes share the type.
+struct CruiserVariant{
+	const char	*name; // The value of CRUISER_MODE that selects it
+	void		(*init)(void);
+	void*		(*malloc)(size_t);
+	void		(*free)(void*);
+	void*		(*realloc)(void*, size_t);
+	void*		(*calloc)(size_t, size_t);
+};
+
+#endif //VARIANT_H